@@ -0,0 +1,377 @@
+/* didl.c - Streaming DIDL-Lite metadata extraction
+ *
+ * Copyright (C) 2012	     Ted Hess (Kitschensync)
+ *
+ * This file is part of UPnPMPD.
+ *
+ * UPnPMPD is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * UPnPMPD is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with UPnPMPD; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+
+/*
+ * Controllers hand us a DIDL-Lite document with every SetAVTransportURI
+ * but we only need a handful of fields out of it. Rather than building
+ * (and tearing down) a DOM, scan the text once and copy the fields of the
+ * first item into a single buffer. Every field is no longer than its
+ * source text, so one allocation the size of the input always suffices.
+ *
+ * Going the other way, didl_write() walks a static template (terminated
+ * by a NULL 'open') and streams escaped values straight into a buffer.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logging.h"
+#include "xmlescape.h"
+#include "didl.h"
+
+#define DIDL_SPACE	" \t\r\n"
+
+// Local part of an element or attribute name (drop namespace prefix)
+DBG_STATIC const char *didl_local(const char *name, size_t *len)
+{
+	const char *colon;
+
+	colon = memchr(name, ':', *len);
+	if (colon == NULL)
+		return name;
+
+	*len -= (colon + 1) - name;
+
+	return colon + 1;
+}
+
+DBG_STATIC int didl_is(const char *name, size_t len, const char *what)
+{
+	return (strlen(what) == len) && (memcmp(name, what, len) == 0);
+}
+
+// Find the '>' ending a tag - skipping quoted attribute values
+DBG_STATIC const char *didl_tag_end(const char *p)
+{
+	char quote = '\0';
+
+	for (; *p; p++)
+	{
+		if (quote)
+		{
+			if (*p == quote)
+				quote = '\0';
+		}
+		else if ((*p == '"') || (*p == '\''))
+		{
+			quote = *p;
+		}
+		else if (*p == '>')
+		{
+			return p;
+		}
+	}
+
+	return NULL;
+}
+
+// Append UTF-8 encoding of a character reference
+DBG_STATIC char *didl_utf8(char *out, unsigned long cp)
+{
+	if ((cp == 0) || (cp > 0x10FFFF))
+		return out;
+
+	if (cp < 0x80)
+	{
+		*out++ = cp;
+	}
+	else if (cp < 0x800)
+	{
+		*out++ = 0xC0 | (cp >> 6);
+		*out++ = 0x80 | (cp & 0x3F);
+	}
+	else if (cp < 0x10000)
+	{
+		*out++ = 0xE0 | (cp >> 12);
+		*out++ = 0x80 | ((cp >> 6) & 0x3F);
+		*out++ = 0x80 | (cp & 0x3F);
+	}
+	else
+	{
+		*out++ = 0xF0 | (cp >> 18);
+		*out++ = 0x80 | ((cp >> 12) & 0x3F);
+		*out++ = 0x80 | ((cp >> 6) & 0x3F);
+		*out++ = 0x80 | (cp & 0x3F);
+	}
+
+	return out;
+}
+
+// Copy character data (trimmed, entities resolved) and terminate it
+// Returns start of the copy, '*out' is advanced past it
+DBG_STATIC const char *didl_copy(char **out, const char *src, size_t len, int entities)
+{
+	const char *end = src + len;
+	const char *semi;
+	char *start = *out;
+	char *dst = *out;
+
+	while ((src < end) && strchr(DIDL_SPACE, *src))
+		src++;
+	while ((end > src) && strchr(DIDL_SPACE, end[-1]))
+		end--;
+
+	while (src < end)
+	{
+		if (entities && (*src == '&') && ((semi = memchr(src, ';', end - src)) != NULL))
+		{
+			const char *ent = src + 1;
+			size_t elen = semi - ent;
+
+			if (didl_is(ent, elen, "lt"))
+				*dst++ = '<';
+			else if (didl_is(ent, elen, "gt"))
+				*dst++ = '>';
+			else if (didl_is(ent, elen, "amp"))
+				*dst++ = '&';
+			else if (didl_is(ent, elen, "quot"))
+				*dst++ = '"';
+			else if (didl_is(ent, elen, "apos"))
+				*dst++ = '\'';
+			else if ((elen > 2) && (ent[0] == '#') && (ent[1] == 'x'))
+				dst = didl_utf8(dst, strtoul(ent + 2, NULL, 16));
+			else if ((elen > 1) && (ent[0] == '#'))
+				dst = didl_utf8(dst, strtoul(ent + 1, NULL, 10));
+			else
+			{
+				// Unknown entity - keep as is
+				memcpy(dst, src, (semi + 1) - src);
+				dst += (semi + 1) - src;
+			}
+
+			src = semi + 1;
+			continue;
+		}
+
+		*dst++ = *src++;
+	}
+
+	*dst++ = '\0';
+	*out = dst;
+
+	return start;
+}
+
+// Pick the wanted attributes out of the first <res> tag
+DBG_STATIC void didl_res(const char *p, const char *end, struct didl_item *item, char **out)
+{
+	const char *name, *val, *vend;
+	size_t nlen;
+
+	for (;;)
+	{
+		p += strspn(p, DIDL_SPACE);
+		if ((p >= end) || (*p == '/'))
+			break;
+
+		name = p;
+		nlen = strcspn(p, "=" DIDL_SPACE);
+		p += nlen;
+		p += strspn(p, DIDL_SPACE);
+		if ((p >= end) || (*p != '='))
+			break;
+		p++;
+		p += strspn(p, DIDL_SPACE);
+		if ((*p != '"') && (*p != '\''))
+			break;
+
+		val = p + 1;
+		vend = memchr(val, *p, end - val);
+		if (vend == NULL)
+			break;
+		p = vend + 1;
+
+		name = didl_local(name, &nlen);
+		if (didl_is(name, nlen, "duration"))
+			item->duration = didl_copy(out, val, vend - val, 1);
+		else if (didl_is(name, nlen, "protocolInfo"))
+			item->protocol_info = didl_copy(out, val, vend - val, 1);
+		else if (didl_is(name, nlen, "size"))
+			item->size = didl_copy(out, val, vend - val, 1);
+		else if (didl_is(name, nlen, "bitrate"))
+			item->bitrate = didl_copy(out, val, vend - val, 1);
+	}
+
+	return;
+}
+
+// Which field (if any) takes the text of this element
+DBG_STATIC const char **didl_text_field(const char *name, size_t len, struct didl_item *item)
+{
+	const char **field = NULL;
+
+	if (didl_is(name, len, "title"))
+		field = &item->title;
+	else if (didl_is(name, len, "artist"))
+		field = &item->artist;
+	else if (didl_is(name, len, "album"))
+		field = &item->album;
+	else if (didl_is(name, len, "albumArtURI"))
+		field = &item->album_art;
+	else if (didl_is(name, len, "class"))
+		field = &item->upnp_class;
+
+	// First occurrence wins
+	return (field && (*field == NULL)) ? field : NULL;
+}
+
+// Extract fields of the first item in a DIDL-Lite document
+// Returns 0 on success, release with didl_free()
+int didl_parse(const char *metadata, struct didl_item *item)
+{
+	const char *p, *lt, *end, *name, *attrs;
+	const char **text = NULL;
+	int have_res = 0;
+	size_t nlen;
+	char *out;
+
+	memset(item, 0, sizeof(struct didl_item));
+
+	if ((metadata == NULL) || (*metadata == '\0'))
+		return -1;
+
+	item->store = malloc(strlen(metadata) + 1);
+	if (item->store == NULL)
+		return -1;
+	out = item->store;
+
+	p = metadata;
+	while ((lt = strchr(p, '<')) != NULL)
+	{
+		// Character data of a wanted element
+		if (text && (lt > p) && (p[strspn(p, DIDL_SPACE)] != '<'))
+		{
+			*text = didl_copy(&out, p, lt - p, 1);
+			text = NULL;
+		}
+
+		p = lt + 1;
+
+		if (strncmp(p, "!--", 3) == 0)
+		{
+			end = strstr(p + 3, "-->");
+			if (end == NULL)
+				break;
+			p = end + 3;
+			continue;
+		}
+
+		if (strncmp(p, "![CDATA[", 8) == 0)
+		{
+			end = strstr(p + 8, "]]>");
+			if (end == NULL)
+				break;
+			if (text)
+			{
+				*text = didl_copy(&out, p + 8, end - (p + 8), 0);
+				text = NULL;
+			}
+			p = end + 3;
+			continue;
+		}
+
+		end = didl_tag_end(p);
+		if (end == NULL)
+			break;
+
+		text = NULL;
+
+		if (*p == '/')
+		{
+			// Only the first item (or container) is of interest
+			name = p + 1;
+			nlen = strcspn(name, DIDL_SPACE ">");
+			name = didl_local(name, &nlen);
+			if (didl_is(name, nlen, "item") || didl_is(name, nlen, "container"))
+				break;
+		}
+		else if ((*p != '?') && (*p != '!'))
+		{
+			nlen = strcspn(p, DIDL_SPACE "/>");
+			attrs = p + nlen;
+			name = didl_local(p, &nlen);
+
+			if (didl_is(name, nlen, "res"))
+			{
+				if (!have_res)
+					didl_res(attrs, end, item, &out);
+				have_res = 1;
+			}
+			else if (end[-1] != '/')
+			{
+				text = didl_text_field(name, nlen, item);
+			}
+		}
+
+		p = end + 1;
+	}
+
+	DBG_PRINT(DBG_LVL4, "DIDL: duration=%s class=%s title=%s\n",
+		  (item->duration) ? item->duration : "<none>",
+		  (item->upnp_class) ? item->upnp_class : "<none>",
+		  (item->title) ? item->title : "<none>");
+
+	return 0;
+}
+
+void didl_free(struct didl_item *item)
+{
+	if (item->store)
+		free(item->store);
+
+	memset(item, 0, sizeof(struct didl_item));
+
+	return;
+}
+
+// Append a DIDL-Lite document built from a template and its field values
+void didl_write(GString *buf, const struct didl_template *tpl, const char **values)
+{
+	const char *value;
+
+	for (; tpl->open; tpl++)
+	{
+		if (tpl->field == DIDL_LITERAL)
+		{
+			g_string_append(buf, tpl->open);
+			continue;
+		}
+
+		value = values[tpl->field];
+		if (value == NULL)
+			continue;
+
+		g_string_append(buf, tpl->open);
+		xmlescape_append(buf, value, 1);
+		if (tpl->close)
+			g_string_append(buf, tpl->close);
+	}
+
+	return;
+}
@@ -0,0 +1,60 @@
+/* didl.h - DIDL-Lite metadata extraction
+ *
+ * Copyright (C) 2012	     Ted Hess (Kitschensync)
+ *
+ * This file is part of UPnPMPD.
+ *
+ * UPnPMPD is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * UPnPMPD is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with UPnPMPD; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _DIDL_H
+#define _DIDL_H
+
+#include <glib.h>
+
+// Fields of the first item in a DIDL-Lite document (NULL if absent)
+struct didl_item
+{
+	const char *duration;		// res@duration
+	const char *protocol_info;	// res@protocolInfo
+	const char *size;			// res@size
+	const char *bitrate;		// res@bitrate
+	const char *title;			// dc:title
+	const char *artist;			// upnp:artist
+	const char *album;			// upnp:album
+	const char *album_art;		// upnp:albumArtURI
+	const char *upnp_class;		// upnp:class
+	char *store;				// Backing storage for all of the above
+};
+
+// One step of a DIDL-Lite writer template: 'open', the escaped value of
+// 'field' and 'close' are appended in turn. A step whose value is NULL is
+// left out entirely so optional elements and attributes need no special case.
+struct didl_template
+{
+	const char *open;
+	int field;					// Index into values or DIDL_LITERAL
+	const char *close;
+};
+
+#define DIDL_LITERAL	-1
+
+extern int didl_parse(const char *metadata, struct didl_item *item);
+extern void didl_free(struct didl_item *item);
+extern void didl_write(GString *buf, const struct didl_template *tpl, const char **values);
+
+#endif /* _DIDL_H */
@@ -0,0 +1,175 @@
+/* dispatch.c - Name lookup tables for request dispatch
+ *
+ * Copyright (C) 2012	     Ted Hess (Kitschensync)
+ *
+ * This file is part of UPnPMPD.
+ *
+ * UPnPMPD is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * UPnPMPD is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with UPnPMPD; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+
+/*
+ * Service IDs and action names are fixed once the device is registered,
+ * so each set is compiled into an open addressed table. The builder
+ * tries a handful of hash seeds looking for one without collisions, then
+ * every lookup is one hash of the key and a single slot; hash and length
+ * are checked before the bytes. Linear probing covers the (unlikely)
+ * case where no such seed turns up.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logging.h"
+#include "dispatch.h"
+
+// Seeds tried for a collision free table (per table size)
+#define DISPATCH_SEEDS	256
+// Table sizes tried (doubling from twice the number of keys)
+#define DISPATCH_GROW	3
+
+struct dispatch_slot
+{
+	const char *key;		// NULL := empty
+	size_t len;
+	unsigned int hash;
+	void *value;
+};
+
+struct dispatch
+{
+	unsigned int seed;
+	unsigned int mask;
+	int collisions;
+	struct dispatch_slot slots[];
+};
+
+DBG_STATIC unsigned int dispatch_hash(unsigned int seed, const char *key, size_t *len)
+{
+	const unsigned char *p;
+	unsigned int hash = 2166136261u ^ (seed * 0x9e3779b9u);
+
+	for (p = (const unsigned char *)key; *p; p++)
+		hash = (hash ^ *p) * 16777619u;
+
+	*len = (const char *)p - key;
+
+	// Fold high bits into the slot index
+	return hash ^ (hash >> 16);
+}
+
+// Fill the table with 'seed', returns the number of collisions
+DBG_STATIC int dispatch_fill(struct dispatch *table, unsigned int seed,
+			     const char **keys, void **values, int count)
+{
+	struct dispatch_slot *slot;
+	unsigned int hash, i;
+	int collisions = 0;
+	size_t len;
+	int n;
+
+	memset(table->slots, 0, (table->mask + 1) * sizeof(struct dispatch_slot));
+	table->seed = seed;
+
+	for (n = 0; n < count; n++)
+	{
+		hash = dispatch_hash(seed, keys[n], &len);
+		for (i = hash & table->mask; table->slots[i].key; i = (i + 1) & table->mask)
+			collisions++;
+
+		slot = &table->slots[i];
+		slot->key = keys[n];
+		slot->len = len;
+		slot->hash = hash;
+		slot->value = values[n];
+	}
+
+	return collisions;
+}
+
+struct dispatch *dispatch_new(const char **keys, void **values, int count)
+{
+	struct dispatch *table = NULL;
+	unsigned int size = 8;
+	unsigned int seed;
+	int grow;
+
+	// At most half full
+	while (size < 2 * (unsigned int)count)
+		size *= 2;
+
+	// Widen the table if no seed separates the keys
+	for (grow = 0; grow < DISPATCH_GROW; grow++, size *= 2)
+	{
+		if (table)
+			free(table);
+
+		table = malloc(sizeof(struct dispatch) + size * sizeof(struct dispatch_slot));
+		if (table == NULL)
+		{
+			fprintf(stderr, "%s: allocation failed (%u)\n", __FUNCTION__, size);
+			return NULL;
+		}
+
+		table->mask = size - 1;
+
+		for (seed = 0; seed < DISPATCH_SEEDS; seed++)
+		{
+			table->collisions = dispatch_fill(table, seed, keys, values, count);
+			if (table->collisions == 0)
+				goto out;
+		}
+	}
+
+	// Keep the last size, probing resolves the rest
+	table->collisions = dispatch_fill(table, 0, keys, values, count);
+
+out:
+	DBG_PRINT(DBG_LVL4, "%s: %d keys in %u slots (seed %u, %d collisions)\n",
+		  __FUNCTION__, count, table->mask + 1, table->seed, table->collisions);
+
+	return table;
+}
+
+void dispatch_free(struct dispatch *table)
+{
+	free(table);
+
+	return;
+}
+
+void *dispatch_lookup(const struct dispatch *table, const char *key)
+{
+	const struct dispatch_slot *slot;
+	unsigned int hash, i;
+	size_t len;
+
+	hash = dispatch_hash(table->seed, key, &len);
+
+	for (i = hash & table->mask; (slot = &table->slots[i])->key; i = (i + 1) & table->mask)
+	{
+		if ((slot->hash == hash) && (slot->len == len) && (memcmp(slot->key, key, len) == 0))
+			return slot->value;
+	}
+
+	return NULL;
+}
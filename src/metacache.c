@@ -0,0 +1,220 @@
+/* metacache.c - Parsed transport metadata cache
+ *
+ * Copyright (C) 2012	     Ted Hess (Kitschensync)
+ *
+ * This file is part of UPnPMPD.
+ *
+ * UPnPMPD is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * UPnPMPD is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with UPnPMPD; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+
+/*
+ * Controllers re-send the same URI with the same (often multi-kilobyte)
+ * DIDL-Lite on re-queue, repeat or 'play again'. Keep the parsed result of
+ * the last few SetAVTransportURI calls, keyed by a hash of URI and
+ * metadata, so a repeat is a lookup instead of another parse.
+ *
+ * Note: all callers must hold transport_mutex. Entries returned stay
+ * valid until the next lookup.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logging.h"
+#include "metacache.h"
+
+#define METACACHE_BUCKETS	64
+
+static struct meta_entry *metacache_buckets[METACACHE_BUCKETS];
+
+// LRU list - head is most recently used
+static struct meta_entry *metacache_head = NULL;
+static struct meta_entry *metacache_tail = NULL;
+static int metacache_count = 0;
+
+// Read by the statistics log on the main loop
+static gint metacache_hits = 0;
+static gint metacache_misses = 0;
+
+// FNV-1a over URI and metadata (NUL separated)
+DBG_STATIC unsigned int metacache_hash(const char *uri, const char *metadata)
+{
+	unsigned int hash = 2166136261u;
+	const unsigned char *p;
+
+	for (p = (const unsigned char *)uri; *p; p++)
+		hash = (hash ^ *p) * 16777619u;
+
+	hash *= 16777619u;
+
+	for (p = (const unsigned char *)metadata; *p; p++)
+		hash = (hash ^ *p) * 16777619u;
+
+	return hash;
+}
+
+DBG_STATIC void metacache_unlink(struct meta_entry *entry)
+{
+	if (entry->prev)
+		entry->prev->next = entry->next;
+	else
+		metacache_head = entry->next;
+
+	if (entry->next)
+		entry->next->prev = entry->prev;
+	else
+		metacache_tail = entry->prev;
+
+	entry->prev = entry->next = NULL;
+
+	return;
+}
+
+DBG_STATIC void metacache_push(struct meta_entry *entry)
+{
+	entry->prev = NULL;
+	entry->next = metacache_head;
+
+	if (metacache_head)
+		metacache_head->prev = entry;
+	else
+		metacache_tail = entry;
+
+	metacache_head = entry;
+
+	return;
+}
+
+// Drop least recently used entry
+DBG_STATIC void metacache_evict(void)
+{
+	struct meta_entry *entry = metacache_tail;
+	struct meta_entry **link;
+
+	if (entry == NULL)
+		return;
+
+	metacache_unlink(entry);
+
+	for (link = &metacache_buckets[entry->hash % METACACHE_BUCKETS]; *link; link = &(*link)->chain)
+	{
+		if (*link == entry)
+		{
+			*link = entry->chain;
+			break;
+		}
+	}
+
+	didl_free(&entry->item);
+	free(entry->uri);
+	free(entry->metadata);
+	free(entry);
+
+	metacache_count--;
+
+	return;
+}
+
+DBG_STATIC struct meta_entry *metacache_new(const char *uri, const char *metadata, unsigned int hash)
+{
+	struct meta_entry *entry;
+
+	entry = calloc(1, sizeof(struct meta_entry));
+	if (entry == NULL)
+		return NULL;
+
+	entry->uri = strdup(uri);
+	entry->metadata = strdup(metadata);
+	if ((entry->uri == NULL) || (entry->metadata == NULL))
+	{
+		free(entry->uri);
+		free(entry->metadata);
+		free(entry);
+		return NULL;
+	}
+
+	entry->hash = hash;
+
+	// Parse once - duration comes from the first 'res' element
+	if (didl_parse(entry->metadata, &entry->item) == 0)
+		entry->duration = entry->item.duration;
+
+	// The single item is also the current track
+	entry->track_meta = entry->metadata;
+
+	return entry;
+}
+
+// Parsed metadata for a URI (NULL if out of memory)
+const struct meta_entry *metacache_lookup(const char *uri, const char *metadata)
+{
+	struct meta_entry *entry;
+	unsigned int hash;
+
+	if (metadata == NULL)
+		metadata = "";
+
+	hash = metacache_hash(uri, metadata);
+
+	for (entry = metacache_buckets[hash % METACACHE_BUCKETS]; entry; entry = entry->chain)
+	{
+		if ((entry->hash == hash) && (strcmp(entry->uri, uri) == 0) &&
+		    (strcmp(entry->metadata, metadata) == 0))
+			break;
+	}
+
+	if (entry)
+	{
+		g_atomic_int_inc(&metacache_hits);
+
+		// Most recently used
+		metacache_unlink(entry);
+		metacache_push(entry);
+	}
+	else
+	{
+		g_atomic_int_inc(&metacache_misses);
+
+		entry = metacache_new(uri, metadata, hash);
+		if (entry == NULL)
+			return NULL;
+
+		if (metacache_count >= METACACHE_SIZE)
+			metacache_evict();
+
+		entry->chain = metacache_buckets[hash % METACACHE_BUCKETS];
+		metacache_buckets[hash % METACACHE_BUCKETS] = entry;
+		metacache_push(entry);
+		metacache_count++;
+	}
+
+	return entry;
+}
+
+void metacache_stats(unsigned long *hits, unsigned long *misses)
+{
+	*hits = (unsigned int)g_atomic_int_get(&metacache_hits);
+	*misses = (unsigned int)g_atomic_int_get(&metacache_misses);
+
+	return;
+}
@@ -0,0 +1,49 @@
+/* metacache.h - Parsed transport metadata cache
+ *
+ * Copyright (C) 2012	     Ted Hess (Kitschensync)
+ *
+ * This file is part of UPnPMPD.
+ *
+ * UPnPMPD is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * UPnPMPD is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with UPnPMPD; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+
+#ifndef _METACACHE_H
+#define _METACACHE_H
+
+#include "didl.h"
+
+// Number of URI/metadata pairs kept
+#define METACACHE_SIZE	32
+
+struct meta_entry
+{
+	struct meta_entry *prev;	// LRU list (most recent first)
+	struct meta_entry *next;
+	struct meta_entry *chain;	// Hash bucket
+	unsigned int hash;
+	char *uri;
+	char *metadata;
+	struct didl_item item;		// Parsed metadata
+	const char *duration;		// CurrentTrackDuration (NULL if unknown)
+	const char *track_meta;		// CurrentTrackMetaData
+};
+
+extern const struct meta_entry *metacache_lookup(const char *uri, const char *metadata);
+extern void metacache_stats(unsigned long *hits, unsigned long *misses);
+
+#endif /* _METACACHE_H */
@@ -31,6 +31,11 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include <glib.h>
 #include <libconfig.h>
@@ -38,6 +43,8 @@
 #include <mpd/client.h>
 
 #include "logging.h"
+#include "didl.h"
+#include "metacache.h"
 #include "upnp_connmgr.h"
 #include "upnp_control.h"
 #include "upnp_transport.h"
@@ -45,14 +52,46 @@
 
 // Net timeout in seconds
 #define MPD_TIMEOUT_DEFAULT 5
+// Max age of cached player status (msecs)
+#define STATUS_TTL_DEFAULT  2000
+// Ping interval for the command connection (secs), < 0 := off
+#define KEEPALIVE_DEFAULT   30
+// How long SetAVTransportURI waits for a Play to fuse with (msecs), < 0 := off
+#define URI_HOLD_DEFAULT    250
+// Min spacing of volume/seek updates sent to MPD (msecs)
+#define COALESCE_INTERVAL   100
 
 static int mpdvolume = 0;
 static int mutevolume = 0;
 static int track_duration;
-static char tempbuf[32];
 
 static int options_mpd_timeout = 0;
+static int options_status_ttl = 0;
+static int options_keepalive = 0;
+static int options_uri_hold = 0;
+static int options_stats = 0;
+
+// Command connection - only touched by the actor thread
 static struct mpd_connection *mpd_conn = NULL;
+static volatile gint mpd_cnx_state = MPD_CNX_DOWN;
+
+// Reconnect backoff (msecs), doubled per failed attempt plus jitter
+#define RECONNECT_MIN   500
+#define RECONNECT_MAX   30000
+
+static guint reconnect_attempts = 0;
+
+// Last time (secs) the actor talked to MPD
+static volatile gint mpd_last_io = 0;
+
+// Second connection parked in 'idle' to monitor external changes
+static struct mpd_connection *idle_conn = NULL;
+static GIOChannel *idle_channel = NULL;
+static guint idle_watch = 0;
+
+#define IDLE_EVENTS     (MPD_IDLE_PLAYER | MPD_IDLE_MIXER | MPD_IDLE_QUEUE | MPD_IDLE_OPTIONS)
+// Delay before re-establishing a lost idle connection (secs)
+#define IDLE_RETRY      5
 
 static gchar *options_host = NULL;
 static gint options_port = 0;
@@ -62,9 +101,175 @@ static gboolean test_mode = FALSE;
 #define HOST_DEFAULT    "localhost"
 #define PORT_DEFAULT    6600
 
-static ithread_mutex_t mpd_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Guards mpd_snapshot, current_song, track_duration and volume
+static ithread_mutex_t status_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Renderer-side mirror of the MPD queue, kept in sync with 'plchanges'
+// (owned by the actor thread)
+struct queue_entry
+{
+	unsigned id;
+	unsigned duration;
+};
+
+// Player status as last read from MPD
+static struct
+{
+	enum mpd_state state;
+	int song_pos;
+	int song_id;
+	unsigned elapsed_ms;
+	unsigned total_time;
+	unsigned bitrate;
+	unsigned queue_length;
+	unsigned long queue_duration;
+	bool queue_open;	// a stream in the queue - no end for absolute seeks
+	bool random;
+	bool single;
+	bool repeat;
+	bool advanced;		// MPD moved on to the queued next song
+	int finished_id;	// song it moved on from (removed when promoted)
+	long long stamp;	// CLOCK_MONOTONIC msecs when read, 0 := invalid
+} mpd_snapshot;
+
+static struct mpd_song *current_song = NULL;
+
+static struct
+{
+	struct queue_entry *entries;
+	unsigned length;
+	unsigned size;
+	unsigned version;
+	unsigned long duration;
+	unsigned untimed;	// entries without a duration (streams)
+	unsigned next_id;	// song queued by SetNextAVTransportURI, 0 := none
+} mpd_queue;
+
+/*
+ * MPD command actor
+ *
+ * A single thread owns mpd_conn. Callers push typed commands onto a
+ * lock-free stack and wait on a future (or not at all). The actor takes
+ * everything queued at once and sends it to MPD as one command list.
+ */
+typedef enum
+{
+	MPD_CMD_CONNECT,
+	MPD_CMD_STATUS,
+	MPD_CMD_SET_URI,
+	MPD_CMD_SET_NEXT,
+	MPD_CMD_PLAY_URI,
+	MPD_CMD_PLAY,
+	MPD_CMD_STOP,
+	MPD_CMD_PAUSE,
+	MPD_CMD_NEXT,
+	MPD_CMD_PREV,
+	MPD_CMD_SEEK_CUR,
+	MPD_CMD_SEEK_ABS,
+	MPD_CMD_SEEK_POS,
+	MPD_CMD_VOLUME,
+	MPD_CMD_PLAYMODE,
+	MPD_CMD_PING,
+	MPD_CMD_DELETE,
+	MPD_CMD_COUNT
+} mpd_cmd_type;
+
+static const char *mpd_cmd_names[MPD_CMD_COUNT] =
+{
+	"connect",
+	"status",
+	"set uri",
+	"set next uri",
+	"play uri",
+	"play",
+	"stop",
+	"pause",
+	"next",
+	"previous",
+	"seek",
+	"seek absolute",
+	"seek track",
+	"set volume",
+	"play mode",
+	"ping",
+	"delete"
+};
+
+struct mpd_future
+{
+	ithread_cond_t cond;
+	int done;
+	int result;
+};
+
+struct mpd_command
+{
+	struct mpd_command *next;
+	mpd_cmd_type type;
+	bool want_status;	// refresh status in the same round trip
+	const char *uri;
+	unsigned arg;		// song id, queue position or volume
+	int song_id;		// id assigned by 'addid'
+	float pos;		// seek offset (secs)
+	bool single;
+	bool random;
+	bool repeat;
+	// Filled in by the actor
+	unsigned replies;
+	unsigned id_reply;	// which reply carries the 'addid' song id (1-based)
+	bool rejected;
+	int result;
+	struct mpd_future *future;	// NULL := detached, freed by the actor
+	void (*done)(struct mpd_command *cmd);	// detached completion (actor thread)
+};
+
+static struct mpd_command *actor_head = NULL;
+static ithread_t actor_thread;
+static ithread_mutex_t actor_mutex = PTHREAD_MUTEX_INITIALIZER;
+static ithread_cond_t actor_cond = PTHREAD_COND_INITIALIZER;
+static ithread_mutex_t future_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// SetAVTransportURI held back for a following Play
+static struct
+{
+	char *uri;
+	guint timer;
+	unsigned serial;	// ties the timer to the URI it was started for
+	long long stamp;	// when it was set (msecs)
+	bool unplayed;		// no Play since it was set
+} uri_stage;
+
+// Time from SetAVTransportURI until MPD accepted the Play (msecs)
+struct start_stats
+{
+	unsigned long count;
+	long long total;
+	long long max;
+};
+
+static struct
+{
+	struct start_stats fused;	// Play came within the hold window
+	struct start_stats separate;	// URI went out on its own first
+} start_stats;
+
+// Guards uri_stage and start_stats
+static ithread_mutex_t stage_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Latest-value-wins slot for continuous controls (slider drags). The
+// first value goes out at once, later ones at most every
+// COALESCE_INTERVAL and the last one always reaches MPD.
+struct coalescer
+{
+	struct mpd_command cmd;	// latest wanted
+	bool pending;
+	guint timer;
+	volatile gint busy;	// updates still in flight
+};
 
-DBG_STATIC void update_mpd_status(void);
+static struct coalescer volume_slot;
+static struct coalescer seek_slot;
+static ithread_mutex_t coalesce_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 // MIME types list (really?)
 static const char *mpd_mime_types[] =
@@ -97,6 +302,8 @@ static const char *mpd_mime_types[] =
 	NULL
 };
 
+DBG_STATIC gboolean reconnect_schedule(gpointer data);
+
 static void output_printError(const char *tag)
 {
 	const char *message;
@@ -115,6 +322,26 @@ static void output_printError(const char *tag)
 	mpd_connection_free(mpd_conn);
 	mpd_conn = NULL;
 
+	// Lost an established connection - let the supervisor take over
+	if (g_atomic_int_compare_and_exchange(&mpd_cnx_state, MPD_CNX_UP, MPD_CNX_DOWN))
+		g_idle_add(reconnect_schedule, NULL);
+
+	return;
+}
+
+// Commands are small and latency bound; also have the kernel probe
+// otherwise quiet connections. Fails harmlessly on unix sockets.
+DBG_STATIC void tune_socket(struct mpd_connection *conn)
+{
+	int fd = mpd_connection_get_fd(conn);
+	int on = 1;
+
+	if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0)
+		DBG_PRINT(DBG_LVL2, "TCP_NODELAY not set on MPD connection\n");
+
+	if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) < 0)
+		DBG_PRINT(DBG_LVL2, "SO_KEEPALIVE not set on MPD connection\n");
+
 	return;
 }
 
@@ -134,469 +361,1803 @@ DBG_STATIC struct mpd_connection *setup_connection(void)
 		return NULL;
 	}
 
+	tune_socket(mpd_conn);
+
 	if(options_password)
 	{
 		if (!mpd_run_password(mpd_conn, options_password))
+		{
 			output_printError(__FUNCTION__);
+			return NULL;
+		}
 	}
 
+	g_atomic_int_set(&mpd_cnx_state, MPD_CNX_UP);
+
 	return mpd_conn;
 }
 
-// Attempt (re-)connection
-CNX_STATUS check_mpd_connection(bool update_status)
+DBG_STATIC gboolean idle_event(GIOChannel *source, GIOCondition condition, gpointer data);
+
+DBG_STATIC void idle_teardown(void)
 {
-	int rc = STATUS_FAIL;
+	if (idle_watch)
+	{
+		g_source_remove(idle_watch);
+		idle_watch = 0;
+	}
 
-	// If test mode - no connection to MPD
-	if (test_mode)
-		return STATUS_TEST;
+	if (idle_channel)
+	{
+		g_io_channel_unref(idle_channel);
+		idle_channel = NULL;
+	}
+
+	if (idle_conn)
+	{
+		mpd_connection_free(idle_conn);
+		idle_conn = NULL;
+	}
 
-	ithread_mutex_lock(&mpd_mutex);
+	return;
+}
 
-	if (!mpd_conn)
+// Open the monitor connection and park it in 'idle'
+DBG_STATIC int idle_setup(void)
+{
+	idle_conn = mpd_connection_new(options_host, options_port, options_mpd_timeout * 1000);
+	if (idle_conn == NULL)
 	{
-		// Maybe reconnect
-		if (setup_connection() != NULL)
-		{
-			fprintf(stderr, "-> Reconnect OK\n");
-			// want status update?
-			if (update_status)
-				update_mpd_status();
-			// Success
-			rc = STATUS_OK;
-		}
+		fputs("MPD idle connection - no memory!\n", stderr);
+		return -1;
 	}
-	else
-		rc = STATUS_OK;
 
-	ithread_mutex_unlock(&mpd_mutex);
+	if (mpd_connection_get_error(idle_conn) != MPD_ERROR_SUCCESS)
+		goto fail;
 
-	return rc;
+	tune_socket(idle_conn);
+
+	if (options_password && !mpd_run_password(idle_conn, options_password))
+		goto fail;
+
+	if (!mpd_send_idle_mask(idle_conn, IDLE_EVENTS))
+		goto fail;
+
+	// Watch the socket from the main loop
+	idle_channel = g_io_channel_unix_new(mpd_connection_get_fd(idle_conn));
+	idle_watch = g_io_add_watch(idle_channel, G_IO_IN | G_IO_HUP | G_IO_ERR,
+				    idle_event, NULL);
+
+	DBG_PRINT(DBG_LVL2, "MPD idle monitor started\n");
+
+	return 0;
+
+fail:
+	fprintf(stderr, "error: (%s) returned %s\n", __FUNCTION__,
+		mpd_connection_get_error_message(idle_conn));
+	idle_teardown();
+
+	return -1;
 }
 
-// Convert UPnP time HH:MM:SS
-// *** TODO: Need to handle relative time correctly !!
-DBG_STATIC int parsetimetosecs(const char *value)
+DBG_STATIC gboolean idle_retry(gpointer data)
 {
-	int hrs, mins, secs;
-	char *nptr;
+	// Keep trying until MPD comes back
+	return (idle_setup() == 0) ? FALSE : TRUE;
+}
 
-	// May be NULL
-	if (!value)
-		return 0;
+// Drop the idle connection and retry later
+DBG_STATIC void idle_lost(void)
+{
+	fprintf(stderr, "MPD idle connection lost: %s\n",
+		mpd_connection_get_error_message(idle_conn));
 
-	hrs = strtol(value, &nptr, 10);
-	nptr++;
-	mins = strtol(nptr, &nptr, 10);
-	nptr++;
-	secs = strtol(nptr, &nptr, 10);
+	// Source is removed by returning FALSE from the watch
+	idle_watch = 0;
+	idle_teardown();
 
-	return hrs * 3600 + mins * 60 + secs;
+	g_timeout_add_seconds(IDLE_RETRY, idle_retry, NULL);
+
+	return;
 }
 
-void output_set_uri(const char *uri)
+// Main loop callback - MPD reported changes on the idle connection
+DBG_STATIC gboolean idle_event(GIOChannel *source, GIOCondition condition, gpointer data)
 {
-	DBG_PRINT(DBG_LVL1, "%s: setting MPD uri to '%s'\n", __FUNCTION__, uri);
+	enum mpd_idle events = 0;
 
-	if (mpd_conn == NULL)
-		return;
+	if ((condition & G_IO_IN) != 0)
+		events = mpd_recv_idle(idle_conn, false);
+
+	// Nothing but 'noidle' yields an empty event set
+	if (events == 0)
+	{
+		idle_lost();
+		return FALSE;
+	}
+
+	DBG_PRINT(DBG_LVL4, "MPD idle events: 0x%x\n", events);
 
-	ithread_mutex_lock(&mpd_mutex);
+	// Cached status is out of date
+	output_invalidate_status();
 
-	// Clear existing playlist (we want this to be the only entry)
-	mpd_run_clear(mpd_conn);
-	// Reflect updated (STOPPED) player status
+	// Refresh state and notify subscribers
+	transport_notify_status();
 
-	// URI is already UTF8
-	if (!mpd_run_add(mpd_conn, uri))
+	if (events & MPD_IDLE_MIXER)
+		control_notify_status();
+
+	// Wait for the next change
+	if (!mpd_send_idle_mask(idle_conn, IDLE_EVENTS))
 	{
-		if (mpd_connection_get_error(mpd_conn) == MPD_ERROR_SERVER)
-		{
-			/* we've got an error message from the server */
-			const char *message = mpd_connection_get_error_message(mpd_conn);
-			//message = charset_from_utf8(message);
-			fprintf(stderr, "Error adding %s: %s\n", uri, message);
-		}
-		else
-		{
-			output_printError(__FUNCTION__);
-		}
+		idle_lost();
+		return FALSE;
 	}
 
-	ithread_mutex_unlock(&mpd_mutex);
-
-	return;
+	return TRUE;
 }
 
-int output_play(void)
+// Convert UPnP time H+:MM:SS[.F+] or H+:MM:SS[.F0/F1] to msecs
+// Returns -1 if malformed (includes "NOT_IMPLEMENTED")
+DBG_STATIC long long parse_upnp_time(const char *value)
 {
-	int rc = 0;
+	long long hrs, ms = 0;
+	long mins, secs;
+	const char *p, *frac;
+	char *nptr;
 
-	// Return success if test mode enabled
-	if (test_mode)
-		return 0;
+	// May be NULL
+	if (!value)
+		return -1;
+
+	hrs = strtoll(value, &nptr, 10);
+	if ((nptr == value) || (hrs < 0) || (*nptr != ':'))
+		return -1;
+
+	p = nptr + 1;
+	mins = strtol(p, &nptr, 10);
+	if ((nptr == p) || (mins < 0) || (mins > 59) || (*nptr != ':'))
+		return -1;
 
-	ithread_mutex_lock(&mpd_mutex);
+	p = nptr + 1;
+	secs = strtol(p, &nptr, 10);
+	if ((nptr == p) || (secs < 0) || (secs > 59))
+		return -1;
 
-	if (!mpd_run_play(mpd_conn))
+	p = nptr;
+	if (*p == '.')
 	{
-		if (mpd_connection_get_error(mpd_conn) == MPD_ERROR_SERVER)
+		frac = ++p;
+		while (isdigit((unsigned char)*p))
+			p++;
+		if (p == frac)
+			return -1;
+
+		if (*p == '/')
 		{
-			/* we've got an error message from the server */
-			const char *message = mpd_connection_get_error_message(mpd_conn);
-			//message = charset_from_utf8(message);
-			fprintf(stderr, "error playing stream - %s\n", message);
+			// F0/F1 with F0 < F1
+			unsigned long num, den;
+
+			num = strtoul(frac, NULL, 10);
+			den = strtoul(p + 1, &nptr, 10);
+			if ((nptr == p + 1) || (den == 0) || (num >= den))
+				return -1;
+
+			ms = num * 1000 / den;
+			p = nptr;
 		}
 		else
 		{
-			output_printError(__FUNCTION__);
+			// Decimal fraction - msec resolution
+			int scale;
+
+			for (scale = 100; (frac < p) && scale; frac++, scale /= 10)
+				ms += (*frac - '0') * scale;
 		}
-		// Return error
-		rc = -1;
-	}
-	else
-	{
-		// OK - update status
-		update_mpd_status();
 	}
 
-	ithread_mutex_unlock(&mpd_mutex);
+	if (*p != '\0')
+		return -1;
 
-	return rc;
+	return ((hrs * 60 + mins) * 60 + secs) * 1000 + ms;
 }
 
-int output_stop(void)
+DBG_STATIC long long monotonic_ms(void)
 {
-	int rc = 0;
+	struct timespec ts;
 
-	// Return success if test mode enabled
-	if (test_mode)
-		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-	ithread_mutex_lock(&mpd_mutex);
+// Store one 'plchanges' entry in the queue mirror
+DBG_STATIC void queue_update_entry(struct mpd_song *song)
+{
+	struct queue_entry *entry;
+	unsigned pos;
 
-	if (!mpd_run_stop(mpd_conn))
+	pos = mpd_song_get_pos(song);
+	if (pos >= mpd_queue.size)
 	{
-		if (mpd_connection_get_error(mpd_conn) == MPD_ERROR_SERVER)
-		{
-			/* we've got an error message from the server */
-			const char *message = mpd_connection_get_error_message(mpd_conn);
-			//message = charset_from_utf8(message);
-			fprintf(stderr, "error stopping stream - %s\n", message);
-		}
-		else
+		unsigned newsize = (mpd_queue.size) ? mpd_queue.size : 64;
+
+		while (newsize <= pos)
+			newsize *= 2;
+
+		entry = realloc(mpd_queue.entries, newsize * sizeof(struct queue_entry));
+		if (entry == NULL)
 		{
-			output_printError(__FUNCTION__);
+			fprintf(stderr, "%s: allocation failed (%u)\n", __FUNCTION__, newsize);
+			return;
 		}
-		// Return error
-		rc = -1;
+		mpd_queue.entries = entry;
+		mpd_queue.size = newsize;
 	}
-	else
+
+	// New positions start out empty
+	while (mpd_queue.length <= pos)
 	{
-		// OK - update status
-		update_mpd_status();
+		mpd_queue.entries[mpd_queue.length].id = 0;
+		mpd_queue.entries[mpd_queue.length].duration = 0;
+		mpd_queue.length++;
+		mpd_queue.untimed++;
 	}
 
-	ithread_mutex_unlock(&mpd_mutex);
+	entry = &mpd_queue.entries[pos];
+	mpd_queue.duration -= entry->duration;
+	if (entry->duration == 0)
+		mpd_queue.untimed--;
+	entry->id = mpd_song_get_id(song);
+	entry->duration = mpd_song_get_duration(song);
+	mpd_queue.duration += entry->duration;
+	if (entry->duration == 0)
+		mpd_queue.untimed++;
 
-	return rc;
+	return;
 }
 
-int output_pause(void)
+// Drop entries removed from the end of the queue
+DBG_STATIC void queue_truncate(unsigned length)
 {
-	int rc = 0;
+	while (mpd_queue.length > length)
+	{
+		mpd_queue.length--;
+		mpd_queue.duration -= mpd_queue.entries[mpd_queue.length].duration;
+		if (mpd_queue.entries[mpd_queue.length].duration == 0)
+			mpd_queue.untimed--;
+	}
 
-	// Return success if test mode enabled
-	if (test_mode)
-		return 0;
+	return;
+}
 
-	ithread_mutex_lock(&mpd_mutex);
+DBG_STATIC bool queue_has_id(unsigned id)
+{
+	unsigned i;
 
-	if (!mpd_run_pause(mpd_conn, true))
-	{
-		if (mpd_connection_get_error(mpd_conn) == MPD_ERROR_SERVER)
-		{
-			/* we've got an error message from the server */
-			const char *message = mpd_connection_get_error_message(mpd_conn);
-			//message = charset_from_utf8(message);
-			fprintf(stderr, "error pausing stream - %s\n", message);
-		}
-		else
-		{
-			output_printError(__FUNCTION__);
-		}
-		// Return error
-		rc = -1;
-	}
-	else
+	for (i = 0; i < mpd_queue.length; i++)
 	{
-		// OK - update status
-		update_mpd_status();
+		if (mpd_queue.entries[i].id == id)
+			return true;
 	}
 
-	ithread_mutex_unlock(&mpd_mutex);
+	return false;
+}
 
-	return rc;
+// Note: caller must hold status_mutex
+DBG_STATIC void snapshot_status(struct mpd_status *mstatus)
+{
+	mpd_snapshot.state = mpd_status_get_state(mstatus);
+	mpd_snapshot.song_pos = mpd_status_get_song_pos(mstatus);
+	mpd_snapshot.song_id = mpd_status_get_song_id(mstatus);
+	mpd_snapshot.elapsed_ms = mpd_status_get_elapsed_ms(mstatus);
+	mpd_snapshot.total_time = mpd_status_get_total_time(mstatus);
+	mpd_snapshot.bitrate = mpd_status_get_kbit_rate(mstatus);
+	mpd_snapshot.queue_length = mpd_queue.length;
+	mpd_snapshot.queue_duration = mpd_queue.duration;
+	mpd_snapshot.queue_open = (mpd_queue.untimed != 0);
+	mpd_snapshot.random = mpd_status_get_random(mstatus);
+	mpd_snapshot.single = mpd_status_get_single(mstatus);
+	mpd_snapshot.repeat = mpd_status_get_repeat(mstatus);
+	mpd_snapshot.stamp = monotonic_ms();
+
+	return;
 }
 
-int output_next(void)
+// Note: caller must hold status_mutex
+DBG_STATIC bool snapshot_fresh(void)
 {
-	int rc = 0;
+	return (mpd_snapshot.stamp != 0) &&
+		(monotonic_ms() - mpd_snapshot.stamp < options_status_ttl);
+}
 
-	// Return success if test mode enabled
-	if (test_mode)
-		return 0;
+// Status, current song and queue changes since our last look
+DBG_STATIC bool status_send(void)
+{
+	return mpd_send_status(mpd_conn) &&
+		mpd_send_current_song(mpd_conn) &&
+		mpd_send_queue_changes_meta(mpd_conn, mpd_queue.version);
+}
+
+DBG_STATIC bool status_recv(void)
+{
+	struct mpd_status *mstatus;
+	struct mpd_song *song, *cursong;
+	int prev_id;
+	bool ok;
 
-	ithread_mutex_lock(&mpd_mutex);
+	mstatus = mpd_recv_status(mpd_conn);
+	if (mstatus == NULL)
+		return false;
 
-	if (!mpd_run_next(mpd_conn))
+	if (!mpd_response_next(mpd_conn))
 	{
-		if (mpd_connection_get_error(mpd_conn) == MPD_ERROR_SERVER)
-		{
-			/* we've got an error message from the server */
-			const char *message = mpd_connection_get_error_message(mpd_conn);
-			//message = charset_from_utf8(message);
-			fprintf(stderr, "error setting next stream - %s\n", message);
-		}
-		else
+		mpd_status_free(mstatus);
+		return false;
+	}
+
+	cursong = mpd_recv_song(mpd_conn);
+
+	// Queue changes (empty unless the version moved)
+	if (mpd_response_next(mpd_conn))
+	{
+		while ((song = mpd_recv_song(mpd_conn)) != NULL)
 		{
-			output_printError(__FUNCTION__);
+			queue_update_entry(song);
+			mpd_song_free(song);
 		}
-		// Return error
-		rc = -1;
+
+		queue_truncate(mpd_status_get_queue_length(mstatus));
+		mpd_queue.version = mpd_status_get_queue_version(mstatus);
 	}
 	else
 	{
-		// OK - update status
-		update_mpd_status();
+		// Resync the whole queue next time
+		mpd_queue.version = 0;
 	}
 
-	ithread_mutex_unlock(&mpd_mutex);
-
-	return rc;
-}
-
-int output_prev(void)
-{
-	int rc = 0;
+	ok = mpd_response_finish(mpd_conn);
 
-	// Return success if test mode enabled
-	if (test_mode)
-		return 0;
+	// Hand the results over to the publishers
+	ithread_mutex_lock(&status_mutex);
 
-	ithread_mutex_lock(&mpd_mutex);
+	prev_id = mpd_snapshot.song_id;
 
-	if (!mpd_run_previous(mpd_conn))
+	if (cursong != NULL)
 	{
-		if (mpd_connection_get_error(mpd_conn) == MPD_ERROR_SERVER)
-		{
-			/* we've got an error message from the server */
-			const char *message = mpd_connection_get_error_message(mpd_conn);
-			//message = charset_from_utf8(message);
-			fprintf(stderr, "error setting previous stream - %s\n", message);
-		}
-		else
-		{
-			output_printError(__FUNCTION__);
-		}
-		// Return error
-		rc = -1;
+		if (current_song)
+			mpd_song_free(current_song);
+		current_song = cursong;
+
+		// Song duration (0 := look at URI metadata)
+		track_duration = mpd_song_get_duration(cursong);
+		if (track_duration == 0)
+			track_duration = mpd_status_get_total_time(mstatus);
 	}
-	else
+
+	// Current volume setting (unless we are still sending ours)
+	if (!g_atomic_int_get(&volume_slot.busy))
+		mpdvolume = mpd_status_get_volume(mstatus);
+
+	snapshot_status(mstatus);
+
+	// Playing what SetNextAVTransportURI queued - it is current now
+	if ((mpd_queue.next_id != 0) && (mpd_snapshot.song_id == (int)mpd_queue.next_id))
 	{
-		// OK - update status
-		update_mpd_status();
+		mpd_snapshot.advanced = true;
+		mpd_snapshot.finished_id = (prev_id != mpd_snapshot.song_id) ? prev_id : -1;
+		mpd_queue.next_id = 0;
 	}
 
-	ithread_mutex_unlock(&mpd_mutex);
+	ithread_mutex_unlock(&status_mutex);
 
-	return rc;
+	mpd_status_free(mstatus);
+
+	return ok;
 }
 
-int output_seekto(const char *seekmode, const char *seekpos)
+// Queue one command for the current command list
+DBG_STATIC bool command_send(struct mpd_command *cmd)
 {
-	struct mpd_status *mstatus;
-	int sid, seekto;
-	int rc = 0;
+	cmd->replies = 0;
+	cmd->id_reply = 0;
 
-	// Return success if test mode enabled
-	if (test_mode)
-		return 0;
+	switch (cmd->type)
+	{
+	case MPD_CMD_SET_URI:
+		// Clear existing playlist (we want this to be the only entry)
+		mpd_queue.next_id = 0;
+		cmd->replies = 2;
+		cmd->id_reply = 2;
+		return mpd_send_clear(mpd_conn) && mpd_send_add_id(mpd_conn, cmd->uri);
+
+	case MPD_CMD_PLAY_URI:
+		// As above and start it - the new song is at position 0
+		mpd_queue.next_id = 0;
+		cmd->replies = 3;
+		cmd->id_reply = 2;
+		return mpd_send_clear(mpd_conn) && mpd_send_add_id(mpd_conn, cmd->uri) &&
+			mpd_send_play_pos(mpd_conn, 0);
+
+	case MPD_CMD_SET_NEXT:
+	{
+		int song_pos;
+
+		// Replace an earlier next song that has not started yet
+		// (next_id stays until MPD confirms the delete)
+		cmd->arg = 0;
+		ithread_mutex_lock(&status_mutex);
+		song_pos = mpd_snapshot.song_pos;
+		if ((mpd_queue.next_id != 0) && queue_has_id(mpd_queue.next_id) &&
+				(mpd_snapshot.song_id != (int)mpd_queue.next_id))
+			cmd->arg = mpd_queue.next_id;
+		ithread_mutex_unlock(&status_mutex);
+
+		if (cmd->arg != 0)
+		{
+			cmd->replies++;
+			if (!mpd_send_delete_id(mpd_conn, cmd->arg))
+				return false;
+		}
+
+		// Inserted right after the current song so MPD can prefetch it
+		// (appended when nothing is playing)
+		cmd->replies++;
+		cmd->id_reply = cmd->replies;
+		if (song_pos < 0)
+			return mpd_send_add_id(mpd_conn, cmd->uri);
+		return mpd_send_add_id_to(mpd_conn, cmd->uri, song_pos + 1);
+	}
 
-	ithread_mutex_lock(&mpd_mutex);
+	case MPD_CMD_PLAY:
+		cmd->replies = 1;
+		return mpd_send_play(mpd_conn);
 
-	mstatus = mpd_run_status(mpd_conn);
-	if (mstatus == NULL)
+	case MPD_CMD_STOP:
+		cmd->replies = 1;
+		return mpd_send_stop(mpd_conn);
+
+	case MPD_CMD_PAUSE:
+		cmd->replies = 1;
+		return mpd_send_pause(mpd_conn, true);
+
+	case MPD_CMD_NEXT:
+		cmd->replies = 1;
+		return mpd_send_next(mpd_conn);
+
+	case MPD_CMD_PREV:
+		cmd->replies = 1;
+		return mpd_send_previous(mpd_conn);
+
+	case MPD_CMD_SEEK_POS:
+		// Track numbers index the queue mirror
+		if (cmd->arg >= mpd_queue.length)
+		{
+			DBG_PRINT(DBG_LVL1, "Track %u not in queue (%u)\n", cmd->arg + 1, mpd_queue.length);
+			cmd->rejected = true;
+			return true;
+		}
+		cmd->replies = 1;
+		return mpd_send_seek_id_float(mpd_conn, mpd_queue.entries[cmd->arg].id, cmd->pos);
+
+	case MPD_CMD_SEEK_ABS:
 	{
-		if (mpd_connection_get_error(mpd_conn) == MPD_ERROR_SERVER)
+		// The command may be sent again if MPD rejects an earlier one
+		// in the list - leave cmd->pos as it came in
+		double offset = cmd->pos;
+		unsigned i;
+
+		// Absolute time runs across the whole queue (streams end the walk)
+		for (i = 0; i < mpd_queue.length; i++)
 		{
-			/* we've got an error message from the server */
-			const char *message = mpd_connection_get_error_message(mpd_conn);
-			//message = charset_from_utf8(message);
-			fprintf(stderr, "error getting status - %s\n", message);
+			if ((mpd_queue.entries[i].duration == 0) ||
+					(offset < mpd_queue.entries[i].duration))
+				break;
+			offset -= mpd_queue.entries[i].duration;
 		}
-		else
+
+		if (i == mpd_queue.length)
 		{
-			output_printError(__FUNCTION__);
+			DBG_PRINT(DBG_LVL1, "Seek target beyond end of queue\n");
+			cmd->rejected = true;
+			return true;
 		}
+		cmd->replies = 1;
+		return mpd_send_seek_id_float(mpd_conn, mpd_queue.entries[i].id, offset);
+	}
 
-		ithread_mutex_unlock(&mpd_mutex);
-		return -1;
+	case MPD_CMD_SEEK_CUR:
+		cmd->replies = 1;
+		return mpd_send_seek_current(mpd_conn, cmd->pos, false);
+
+	case MPD_CMD_VOLUME:
+		cmd->replies = 1;
+		return mpd_send_set_volume(mpd_conn, cmd->arg);
+
+	case MPD_CMD_PLAYMODE:
+		cmd->replies = 3;
+		return mpd_send_single(mpd_conn, cmd->single) &&
+			mpd_send_random(mpd_conn, cmd->random) &&
+			mpd_send_repeat(mpd_conn, cmd->repeat);
+
+	case MPD_CMD_PING:
+		cmd->replies = 1;
+		return mpd_send_command(mpd_conn, "ping", NULL);
+
+	case MPD_CMD_DELETE:
+		// Already gone (controller or another client removed it)
+		if (!queue_has_id(cmd->arg))
+			return true;
+		cmd->replies = 1;
+		return mpd_send_delete_id(mpd_conn, cmd->arg);
+
+	default:
+		// Status rides at the end of the list
+		return true;
 	}
+}
 
-	if (mpd_status_get_state(mstatus) == MPD_STATE_STOP)
+// Consume the responses for one command
+DBG_STATIC bool command_recv(struct mpd_command *cmd)
+{
+	unsigned i;
+
+	for (i = 0; i < cmd->replies; i++)
 	{
-		DBG_PRINT(DBG_LVL1, "Player stopped -- cannot seek\n");
-		mpd_status_free(mstatus);
+		if (i + 1 == cmd->id_reply)
+		{
+			cmd->song_id = mpd_recv_song_id(mpd_conn);
+			if (cmd->song_id < 0)
+				goto fail;
+		}
 
-		ithread_mutex_unlock(&mpd_mutex);
-		return -1;
+		if (!mpd_response_next(mpd_conn))
+			goto fail;
+
+		// The next song being replaced is gone
+		if ((cmd->type == MPD_CMD_SET_NEXT) && (i + 1 < cmd->id_reply))
+			mpd_queue.next_id = 0;
 	}
 
-	// Get correct song-id
-	sid = mpd_status_get_song_id(mstatus);
+	if (cmd->type == MPD_CMD_SET_NEXT)
+		mpd_queue.next_id = cmd->song_id;
 
-	// Convert HH:MM:SS to seconds
-	seekto = parsetimetosecs(seekpos);
+	if (!cmd->rejected)
+		cmd->result = 0;
 
-	//if (strcmp(seekmode, "REL_TIME") == 0)
-	//    seekto = mpd_status_get_elapsed_time(mstatus) + seekto;
+	return true;
 
-	if (seekto < 0) seekto = 0;
-	if (seekto > track_duration)
-		seekto = track_duration;
+fail:
+	// Unsure what reached the queue - mirror it again from scratch
+	if (cmd->type == MPD_CMD_SET_NEXT)
+		mpd_queue.version = 0;
 
-	DBG_PRINT(DBG_LVL4, "Seeking to: %d in %d from %d\n", seekto, track_duration, mpd_status_get_elapsed_time(mstatus));
+	return false;
+}
 
-	mpd_status_free(mstatus);
+// Run commands [first, end) as one command list, with the status query
+// appended if anyone asked for it. MPD stops at the first command it
+// rejects; the return value is where to resume (end when done).
+DBG_STATIC struct mpd_command *actor_batch(struct mpd_command *first,
+					   struct mpd_command *end, bool *status)
+{
+	struct mpd_command *cmd;
+
+	for (cmd = first; cmd != end; cmd = cmd->next)
+	{
+		if (cmd->want_status)
+			*status = true;
+	}
+
+	if (mpd_conn == NULL)
+	{
+		*status = false;
+		return end;
+	}
+
+	g_atomic_int_set(&mpd_last_io, monotonic_ms() / 1000);
+
+	if (!mpd_command_list_begin(mpd_conn, true))
+		goto fail;
+
+	for (cmd = first; cmd != end; cmd = cmd->next)
+	{
+		if (!command_send(cmd))
+			goto fail;
+	}
+
+	if (*status && !status_send())
+		goto fail;
+
+	if (!mpd_command_list_end(mpd_conn))
+		goto fail;
+
+	for (cmd = first; cmd != end; cmd = cmd->next)
+	{
+		if (command_recv(cmd))
+			continue;
+
+		if (mpd_connection_get_error(mpd_conn) != MPD_ERROR_SERVER)
+			goto fail;
+
+		/* we've got an error message from the server */
+		fprintf(stderr, "error: (%s) returned %s\n", mpd_cmd_names[cmd->type],
+			mpd_connection_get_error_message(mpd_conn));
+		mpd_connection_clear_error(mpd_conn);
+
+		// The rest of the list was skipped
+		return cmd->next;
+	}
+
+	if (*status)
+	{
+		if (!status_recv())
+			goto fail;
+		*status = false;
+	}
+	else if (!mpd_response_finish(mpd_conn))
+		goto fail;
+
+	return end;
+
+fail:
+	output_printError(__FUNCTION__);
+	*status = false;
+
+	return end;
+}
+
+DBG_STATIC void actor_process(struct mpd_command *list)
+{
+	struct mpd_command *cmd, *end, *next;
+	struct mpd_future *future;
+	bool status = false;
+
+	cmd = list;
+	while (cmd != NULL)
+	{
+		if (cmd->type == MPD_CMD_CONNECT)
+		{
+			// Maybe reconnect
+			if ((mpd_conn != NULL) || (setup_connection() != NULL))
+			{
+				cmd->result = 0;
+				if (cmd->want_status)
+					status = true;
+			}
+			cmd = cmd->next;
+			continue;
+		}
+
+		// Everything up to the next connect goes out together
+		for (end = cmd; (end != NULL) && (end->type != MPD_CMD_CONNECT); end = end->next)
+			;
+
+		while (cmd != end)
+			cmd = actor_batch(cmd, end, &status);
+	}
+
+	// Status still owed after a rejected command or connect
+	if (status)
+		actor_batch(NULL, NULL, &status);
+
+	// Complete futures (waiters own their commands again after this)
+	for (cmd = list; cmd != NULL; cmd = next)
+	{
+		next = cmd->next;
+		future = cmd->future;
+
+		if (future == NULL)
+		{
+			if (cmd->done)
+				cmd->done(cmd);
+			free(cmd);
+			continue;
+		}
+
+		ithread_mutex_lock(&future_mutex);
+		future->result = cmd->result;
+		future->done = 1;
+		ithread_cond_signal(&future->cond);
+		ithread_mutex_unlock(&future_mutex);
+	}
+
+	return;
+}
+
+// Take everything queued so far, oldest first
+DBG_STATIC struct mpd_command *actor_take(void)
+{
+	struct mpd_command *head, *list = NULL;
+
+	do
+	{
+		head = g_atomic_pointer_get(&actor_head);
+	} while (!g_atomic_pointer_compare_and_exchange(&actor_head, head, NULL));
+
+	// Stack is newest first
+	while (head != NULL)
+	{
+		struct mpd_command *next = head->next;
+
+		head->next = list;
+		list = head;
+		head = next;
+	}
+
+	return list;
+}
+
+DBG_STATIC void *actor_main(void *arg)
+{
+	for (;;)
+	{
+		ithread_mutex_lock(&actor_mutex);
+		while (g_atomic_pointer_get(&actor_head) == NULL)
+			ithread_cond_wait(&actor_cond, &actor_mutex);
+		ithread_mutex_unlock(&actor_mutex);
+
+		actor_process(actor_take());
+	}
+
+	return NULL;
+}
+
+// Queue a command for the actor. With a NULL future the command must be
+// heap allocated (see command_new) and is freed once processed.
+DBG_STATIC void actor_submit(struct mpd_command *cmd, struct mpd_future *future)
+{
+	struct mpd_command *head;
+
+	cmd->replies = 0;
+	cmd->rejected = false;
+	cmd->song_id = -1;
+	cmd->result = -1;
+	cmd->future = future;
+
+	if (future)
+	{
+		future->done = 0;
+		future->result = -1;
+		ithread_cond_init(&future->cond, NULL);
+	}
+
+	do
+	{
+		head = g_atomic_pointer_get(&actor_head);
+		cmd->next = head;
+	} while (!g_atomic_pointer_compare_and_exchange(&actor_head, head, cmd));
+
+	// First one in - actor may be asleep
+	if (head == NULL)
+	{
+		ithread_mutex_lock(&actor_mutex);
+		ithread_cond_signal(&actor_cond);
+		ithread_mutex_unlock(&actor_mutex);
+	}
+
+	return;
+}
+
+DBG_STATIC int future_wait(struct mpd_future *future)
+{
+	ithread_mutex_lock(&future_mutex);
+	while (!future->done)
+		ithread_cond_wait(&future->cond, &future_mutex);
+	ithread_mutex_unlock(&future_mutex);
+
+	ithread_cond_destroy(&future->cond);
+
+	return future->result;
+}
+
+DBG_STATIC void stage_flush(void);
+
+// Submit and wait for completion
+DBG_STATIC int actor_call(struct mpd_command *cmd)
+{
+	struct mpd_future future;
+
+	// Fail fast while the supervisor is reconnecting
+	if ((cmd->type != MPD_CMD_CONNECT) &&
+			(g_atomic_int_get(&mpd_cnx_state) != MPD_CNX_UP))
+		return -1;
+
+	// A held URI goes first
+	stage_flush();
+
+	actor_submit(cmd, &future);
+
+	return future_wait(&future);
+}
+
+// Allocate a detached command (URI copied along)
+DBG_STATIC struct mpd_command *command_new(mpd_cmd_type type, const char *uri)
+{
+	struct mpd_command *cmd;
+	size_t len = (uri) ? strlen(uri) + 1 : 0;
+
+	cmd = calloc(1, sizeof(struct mpd_command) + len);
+	if (cmd == NULL)
+	{
+		fprintf(stderr, "%s: allocation failed\n", __FUNCTION__);
+		return NULL;
+	}
+
+	cmd->type = type;
+	if (uri)
+		cmd->uri = memcpy(cmd + 1, uri, len);
+
+	return cmd;
+}
+
+// Take the held URI (if any) off the stage
+// Note: caller must hold stage_mutex
+DBG_STATIC char *stage_take(void)
+{
+	char *uri = uri_stage.uri;
+
+	// A timer already waiting for the lock finds the serial moved on
+	if (uri_stage.timer)
+	{
+		g_source_remove(uri_stage.timer);
+		uri_stage.timer = 0;
+	}
+	uri_stage.uri = NULL;
+	uri_stage.serial++;
+
+	return uri;
+}
+
+// Send the held URI on its own. Submitted under stage_mutex so nothing
+// can overtake it on the way to the actor.
+// Note: caller must hold stage_mutex
+DBG_STATIC void stage_send(void)
+{
+	struct mpd_command *cmd;
+	char *uri;
+
+	uri = stage_take();
+	if (uri)
+	{
+		cmd = command_new(MPD_CMD_SET_URI, uri);
+		if (cmd)
+			actor_submit(cmd, NULL);
+
+		DBG_PRINT(DBG_LVL2, "URI held %lld msecs, sent without Play\n",
+			  monotonic_ms() - uri_stage.stamp);
+		free(uri);
+	}
+
+	return;
+}
+
+DBG_STATIC void stage_flush(void)
+{
+	ithread_mutex_lock(&stage_mutex);
+	stage_send();
+	ithread_mutex_unlock(&stage_mutex);
+
+	return;
+}
+
+// Main loop timer - no Play came along in time
+DBG_STATIC gboolean stage_expired(gpointer data)
+{
+	ithread_mutex_lock(&stage_mutex);
+
+	// Play or a newer URI may have taken it while we waited for the lock
+	if (uri_stage.serial == GPOINTER_TO_UINT(data))
+	{
+		// Source goes away when we return FALSE
+		uri_stage.timer = 0;
+		stage_send();
+	}
+
+	ithread_mutex_unlock(&stage_mutex);
+
+	return FALSE;
+}
+
+// Note: caller must hold stage_mutex
+DBG_STATIC void start_stats_add(struct start_stats *stats, long long msecs)
+{
+	stats->count++;
+	stats->total += msecs;
+	if (msecs > stats->max)
+		stats->max = msecs;
+
+	return;
+}
+
+DBG_STATIC void start_stats_print(const char *label, const struct start_stats *stats)
+{
+	if (stats->count == 0)
+		return;
+
+	fprintf(stderr, "  URI to playing (%s): %lu, avg %lld msecs, max %lld msecs\n",
+		label, stats->count, stats->total / (long long)stats->count, stats->max);
+
+	return;
+}
+
+// Main loop timer - log counters for tuning
+DBG_STATIC gboolean stats_report(gpointer data)
+{
+	unsigned long hits, misses;
+
+	fputs("Statistics:\n", stderr);
+
+	metacache_stats(&hits, &misses);
+	fprintf(stderr, "  Metadata cache: %lu hits, %lu misses\n", hits, misses);
+
+	ithread_mutex_lock(&stage_mutex);
+	start_stats_print("fused", &start_stats.fused);
+	start_stats_print("separate", &start_stats.separate);
+	ithread_mutex_unlock(&stage_mutex);
+
+	return TRUE;
+}
+
+DBG_STATIC gboolean coalesce_expired(gpointer data);
+
+// Note: caller must hold coalesce_mutex
+DBG_STATIC void coalesce_send(struct coalescer *slot)
+{
+	struct mpd_command *cmd;
+
+	// A held URI goes first
+	stage_flush();
+
+	cmd = command_new(slot->cmd.type, NULL);
+	if (cmd)
+	{
+		cmd->arg = slot->cmd.arg;
+		cmd->pos = slot->cmd.pos;
+		actor_submit(cmd, NULL);
+	}
+
+	slot->pending = false;
+	g_atomic_int_set(&slot->busy, 1);
+
+	// Nothing else goes out before this fires
+	slot->timer = g_timeout_add(COALESCE_INTERVAL, coalesce_expired, slot);
+
+	return;
+}
+
+// Main loop timer - send whatever came in meanwhile
+DBG_STATIC gboolean coalesce_expired(gpointer data)
+{
+	struct coalescer *slot = data;
+
+	ithread_mutex_lock(&coalesce_mutex);
+
+	slot->timer = 0;
+	if (slot->pending)
+		coalesce_send(slot);
+	else
+		g_atomic_int_set(&slot->busy, 0);
+
+	ithread_mutex_unlock(&coalesce_mutex);
+
+	return FALSE;
+}
+
+DBG_STATIC void coalesce_submit(struct coalescer *slot, const struct mpd_command *cmd)
+{
+	ithread_mutex_lock(&coalesce_mutex);
+
+	slot->cmd = *cmd;
+	slot->pending = true;
+
+	// Idle slot - no reason to wait
+	if (slot->timer == 0)
+		coalesce_send(slot);
+
+	ithread_mutex_unlock(&coalesce_mutex);
+
+	return;
+}
+
+/*
+ * Reconnect supervisor (main loop)
+ *
+ * A dropped command connection is noticed by output_printError. From then
+ * on actions fail fast while reconnects are tried in the background.
+ */
+
+// Back on the main loop after a successful reconnect
+DBG_STATIC gboolean reconnect_restore(gpointer data)
+{
+	fprintf(stderr, "-> Reconnect OK\n");
+
+	reconnect_attempts = 0;
+
+	// Refresh state and notify subscribers
+	output_invalidate_status();
+	transport_notify_status();
+	control_notify_status();
+
+	return FALSE;
+}
+
+// Actor thread - result of a reconnect attempt
+DBG_STATIC void reconnect_done(struct mpd_command *cmd)
+{
+	if (cmd->result == 0)
+	{
+		g_idle_add(reconnect_restore, NULL);
+	}
+	else
+	{
+		g_atomic_int_set(&mpd_cnx_state, MPD_CNX_DOWN);
+		g_idle_add(reconnect_schedule, NULL);
+	}
+
+	return;
+}
+
+DBG_STATIC gboolean reconnect_attempt(gpointer data)
+{
+	struct mpd_command *cmd;
+
+	cmd = command_new(MPD_CMD_CONNECT, NULL);
+	if (cmd == NULL)
+	{
+		reconnect_schedule(NULL);
+		return FALSE;
+	}
+
+	DBG_PRINT(DBG_LVL1, "MPD reconnect attempt %u\n", reconnect_attempts);
+
+	g_atomic_int_set(&mpd_cnx_state, MPD_CNX_CONNECTING);
+
+	cmd->done = reconnect_done;
+	actor_submit(cmd, NULL);
+
+	return FALSE;
+}
+
+// Arm the next attempt with exponential backoff and jitter
+DBG_STATIC gboolean reconnect_schedule(gpointer data)
+{
+	guint delay = RECONNECT_MAX;
+
+	if (reconnect_attempts < 16)
+		delay = MIN(RECONNECT_MIN << reconnect_attempts, RECONNECT_MAX);
+	reconnect_attempts++;
+
+	// Spread retries over [delay/2, delay]
+	delay = delay / 2 + g_random_int_range(0, delay / 2 + 1);
+
+	DBG_PRINT(DBG_LVL1, "MPD reconnect in %u msecs\n", delay);
+
+	g_timeout_add(delay, reconnect_attempt, NULL);
+
+	return FALSE;
+}
+
+// Main loop timer - MPD drops clients quiet for longer than its
+// connection_timeout, so ping a command connection that sat unused
+DBG_STATIC gboolean keepalive_check(gpointer data)
+{
+	struct mpd_command *cmd;
+	gint idle;
+
+	if (g_atomic_int_get(&mpd_cnx_state) != MPD_CNX_UP)
+		return TRUE;
+
+	idle = monotonic_ms() / 1000 - g_atomic_int_get(&mpd_last_io);
+	if (idle * 2 < options_keepalive)
+		return TRUE;
+
+	cmd = command_new(MPD_CMD_PING, NULL);
+	if (cmd)
+		actor_submit(cmd, NULL);
+
+	return TRUE;
+}
+
+MPD_CNX_STATE output_connection_state(void)
+{
+	return g_atomic_int_get(&mpd_cnx_state);
+}
+
+// Connection check for UPnP actions (never blocks)
+CNX_STATUS check_mpd_connection(void)
+{
+	// If test mode - no connection to MPD
+	if (test_mode)
+		return STATUS_TEST;
+
+	return (output_connection_state() == MPD_CNX_UP) ? STATUS_OK : STATUS_FAIL;
+}
+
+/*************************************************************
+ *  DIDL-LITE metadata template for MPD tags                 *
+ *************************************************************/
+
+enum song_field
+{
+	SONG_TITLE,
+	SONG_ARTIST,
+	SONG_ALBUMARTIST,
+	SONG_ALBUM,
+	SONG_COMPOSER,
+	SONG_GENRE,
+	SONG_TRACK,
+	SONG_DISC,
+	SONG_DATE,
+	SONG_MIME,
+	SONG_RATE,
+	SONG_BITS,
+	SONG_CHANNELS,
+	SONG_DURATION,
+	SONG_URI,
+	SONG_FIELD_COUNT
+};
+
+static const struct didl_template song_template[] =
+{
+	{ "<DIDL-Lite xmlns=\"urn:schemas-upnp-org:metadata-1-0/DIDL-Lite/\" "
+		"xmlns:upnp=\"urn:schemas-upnp-org:metadata-1-0/upnp/\" "
+		"xmlns:dc=\"http://purl.org/dc/elements/1.1/\" "
+		"xmlns:dlna=\"urn:schemas-dlna-org:metadata-1-0/\">"
+		"<item id=\"xyzzy$1$0\" parentID=\"xyzzy$1\" restricted=\"1\">"
+		"<upnp:class>object.item.audioItem.musicTrack</upnp:class>", DIDL_LITERAL, NULL },
+	{ "<dc:title>", SONG_TITLE, "</dc:title>" },
+	{ "<dc:creator>", SONG_ARTIST, "</dc:creator>" },
+	{ "<upnp:artist>", SONG_ARTIST, "</upnp:artist>" },
+	{ "<upnp:artist role=\"AlbumArtist\">", SONG_ALBUMARTIST, "</upnp:artist>" },
+	{ "<upnp:album>", SONG_ALBUM, "</upnp:album>" },
+	{ "<upnp:author role=\"Composer\">", SONG_COMPOSER, "</upnp:author>" },
+	{ "<upnp:genre>", SONG_GENRE, "</upnp:genre>" },
+	{ "<upnp:originalTrackNumber>", SONG_TRACK, "</upnp:originalTrackNumber>" },
+	{ "<upnp:originalDiscNumber>", SONG_DISC, "</upnp:originalDiscNumber>" },
+	{ "<dc:date>", SONG_DATE, "</dc:date>" },
+	// Mime type and URI are always present
+	{ "<res protocolInfo=\"http-get:*:", SONG_MIME, ":*\"" },
+	{ " sampleFrequency=\"", SONG_RATE, "\"" },
+	{ " bitsPerSample=\"", SONG_BITS, "\"" },
+	{ " nrAudioChannels=\"", SONG_CHANNELS, "\"" },
+	{ " duration=\"", SONG_DURATION, "\"" },
+	{ ">", SONG_URI, "</res>" },
+	{ "</item></DIDL-Lite>", DIDL_LITERAL, NULL },
+	{ NULL, DIDL_LITERAL, NULL }
+};
+
+// Content types by file suffix (MPD does not report the container)
+static const struct
+{
+	const char *suffix;
+	const char *mime;
+} song_mime_types[] =
+{
+	{ "mp3", "audio/mpeg" },
+	{ "flac", "audio/flac" },
+	{ "ogg", "audio/ogg" },
+	{ "oga", "audio/ogg" },
+	{ "opus", "audio/ogg" },
+	{ "m4a", "audio/mp4" },
+	{ "mp4", "audio/mp4" },
+	{ "aac", "audio/aac" },
+	{ "wav", "audio/wav" },
+	{ "aif", "audio/aiff" },
+	{ "aiff", "audio/aiff" },
+	{ "wma", "audio/x-ms-wma" },
+	{ "dsf", "audio/x-dsf" },
+	{ NULL, NULL }
+};
+
+// Reused for every generated document
+static GString *song_didl = NULL;
+
+DBG_STATIC const char *get_song_mime(const char *uri)
+{
+	const char *dot, *end;
+	size_t len;
+	int i;
+
+	// Ignore any query or fragment
+	end = uri + strcspn(uri, "?#");
+
+	for (dot = end; dot > uri; dot--)
+	{
+		if ((dot[-1] == '.') || (dot[-1] == '/'))
+			break;
+	}
+	if ((dot == uri) || (dot[-1] != '.'))
+		return "*";
+
+	len = end - dot;
+	for (i = 0; song_mime_types[i].suffix; i++)
+	{
+		if ((strlen(song_mime_types[i].suffix) == len) &&
+		    (strncasecmp(dot, song_mime_types[i].suffix, len) == 0))
+			return song_mime_types[i].mime;
+	}
+
+	return "*";
+}
+
+// Track and disc tags may be "n/total" - keep the number only
+DBG_STATIC const char *get_song_number(const char *tag, char *buf, size_t size)
+{
+	int num;
+
+	if ((tag == NULL) || ((num = atoi(tag)) <= 0))
+		return NULL;
+
+	snprintf(buf, size, "%d", num);
+
+	return buf;
+}
+
+DBG_STATIC const char *get_song_tag(struct mpd_song *song, const char *tag)
+{
+	const char *sval;
+	enum mpd_tag_type tag_type;
+
+	// Find ID3 tag values from song data
+	tag_type = mpd_tag_name_iparse(tag);
+	if (tag_type != MPD_TAG_UNKNOWN)
+	{
+		sval = mpd_song_get_tag(song, tag_type, 0);
+		if (sval)
+		{
+			DBG_PRINT(DBG_LVL4, "ID3 tag found %s = %s\n", tag, sval);
+			return sval;
+		}
+	}
+	// Not found
+	return NULL;
+}
+
+DBG_STATIC void get_track_metadata(struct mpd_song *song)
+{
+	const struct mpd_audio_format *format;
+	const char *values[SONG_FIELD_COUNT];
+	const char *sval, *mname;
+	char track[12], disc[12], rate[12], bits[4], channels[4], duration[32];
+	unsigned int ms;
+
+	// Get current meta data
+	sval = transport_get_var(TRANSPORT_VAR_AV_URI_META);
+	if (sval && (strcmp(sval, "") != 0))
+		return;
+
+	// Empty metadata - Do we also have a URI
+	sval = transport_get_var(TRANSPORT_VAR_AV_URI);
+	if (!sval || (strcmp(sval, "") == 0))
+		return;
+
+	// We have URI - make up some metadata
+	memset(values, 0, sizeof(values));
+	values[SONG_TITLE] = get_song_tag(song, "title");
+	values[SONG_ALBUM] = get_song_tag(song, "album");
+	mname = get_song_tag(song, "name");
+
+	// Must have a title or name
+	if (!values[SONG_TITLE] && !mname)
+		return;
+
+	// Use 'name' if no title or album
+	if (!values[SONG_TITLE])
+		values[SONG_TITLE] = mname;
+	else if (!values[SONG_ALBUM])
+		values[SONG_ALBUM] = mname;
+
+	values[SONG_ARTIST] = get_song_tag(song, "artist");
+	values[SONG_ALBUMARTIST] = get_song_tag(song, "albumartist");
+	values[SONG_COMPOSER] = get_song_tag(song, "composer");
+	values[SONG_GENRE] = get_song_tag(song, "genre");
+	values[SONG_TRACK] = get_song_number(get_song_tag(song, "track"), track, sizeof(track));
+	values[SONG_DISC] = get_song_number(get_song_tag(song, "disc"), disc, sizeof(disc));
+	values[SONG_DATE] = get_song_tag(song, "date");
+	values[SONG_MIME] = get_song_mime(sval);
+	values[SONG_URI] = sval;
+
+	format = mpd_song_get_audio_format(song);
+	if (format)
+	{
+		if (format->sample_rate)
+		{
+			snprintf(rate, sizeof(rate), "%u", format->sample_rate);
+			values[SONG_RATE] = rate;
+		}
+		// Skip float and DSD formats
+		if ((format->bits > 0) && (format->bits <= 32))
+		{
+			snprintf(bits, sizeof(bits), "%u", format->bits);
+			values[SONG_BITS] = bits;
+		}
+		if (format->channels)
+		{
+			snprintf(channels, sizeof(channels), "%u", format->channels);
+			values[SONG_CHANNELS] = channels;
+		}
+	}
+
+	ms = mpd_song_get_duration_ms(song);
+	if (ms)
+	{
+		snprintf(duration, sizeof(duration), "%u:%02u:%02u.%03u",
+			 ms / 3600000, (ms / 60000) % 60, (ms / 1000) % 60, ms % 1000);
+		values[SONG_DURATION] = duration;
+	}
+	else
+	{
+		values[SONG_DURATION] = transport_get_var(TRANSPORT_VAR_CUR_TRACK_DUR);
+	}
+
+	// Convert MPD tags to UPnP DCS <DIDL-Lite\>
+	if (song_didl == NULL)
+		song_didl = g_string_sized_new(1024);
+	else
+		g_string_truncate(song_didl, 0);
+
+	didl_write(song_didl, song_template, values);
+
+	// Set track and transport metadata
+	transport_set_var(TRANSPORT_VAR_CUR_TRACK_META, song_didl->str);
+	transport_set_var(TRANSPORT_VAR_AV_URI_META, song_didl->str);
+
+	return;
+}
+
+// Note: caller must hold transport_mutex and status_mutex
+DBG_STATIC void update_track_position(void)
+{
+	long long elapsed;
+
+	// Track # (position in queue)
+	transport_set_number(TRANSPORT_VAR_CUR_TRACK, mpd_snapshot.song_pos + 1);
+
+	// Extrapolate play position from the snapshot while playing
+	elapsed = mpd_snapshot.elapsed_ms;
+	if (mpd_snapshot.state == MPD_STATE_PLAY)
+		elapsed += monotonic_ms() - mpd_snapshot.stamp;
+	if ((track_duration > 0) && (elapsed > track_duration * 1000LL))
+		elapsed = track_duration * 1000LL;
+
+	// play position (relative), formatted only when asked for
+	transport_set_number(TRANSPORT_VAR_REL_CTR_POS, elapsed / 1000);
+	transport_set_number(TRANSPORT_VAR_ABS_CTR_POS, elapsed / 1000);
+	transport_set_number(TRANSPORT_VAR_REL_TIME_POS, elapsed);
+	transport_set_number(TRANSPORT_VAR_ABS_TIME_POS, elapsed);
+
+	return;
+}
+
+//
+// Translate MPD player to UPnP STATE value
+//
+DBG_STATIC void output_translate_state(void)
+{
+
+	switch(mpd_snapshot.state)
+	{
+	case MPD_STATE_UNKNOWN:
+		// no information available
+		fprintf(stderr, "MPD state unknown\n");
+		break;
+
+	case MPD_STATE_STOP:
+		// not playing
+		transport_set_state(TRANSPORT_STOPPED, "STOPPED");
+		break;
+
+	case MPD_STATE_PLAY:
+		// playing
+		transport_set_state(TRANSPORT_PLAYING, "PLAYING");
+		break;
+
+	case MPD_STATE_PAUSE:
+		// playing, but paused
+		transport_set_state(TRANSPORT_PAUSED_PLAYBACK, "PAUSED_PLAYBACK");
+		break;
+	}
+
+	return;
+}
+
+//
+// Translate MPD options to UPnP play mode
+//
+DBG_STATIC void output_translate_playmode(void)
+{
+	char *mode;
+
+	if (mpd_snapshot.random)
+		mode = "RANDOM";
+	else if (mpd_snapshot.single)
+		mode = mpd_snapshot.repeat ? "REPEAT_ONE" : "DIRECT_1";
+	else if (mpd_snapshot.repeat)
+		mode = "REPEAT_ALL";
+	else
+		mode = "NORMAL";
+
+	transport_set_var(TRANSPORT_VAR_CUR_PLAY_MODE, mode);
+
+	return;
+}
+
+// Copy the latest MPD status into the transport state variables
+// Note: caller must hold transport_mutex
+DBG_STATIC void publish_status(void)
+{
+	const char *sval;
+
+	ithread_mutex_lock(&status_mutex);
+
+	// Next URI/metadata become current
+	if (mpd_snapshot.advanced)
+	{
+		transport_promote_next();
+		mpd_snapshot.advanced = false;
+
+		// Drop the finished song so the queue holds current and next only
+		if (mpd_snapshot.finished_id >= 0)
+		{
+			struct mpd_command *cmd = command_new(MPD_CMD_DELETE, NULL);
+
+			if (cmd)
+			{
+				cmd->arg = mpd_snapshot.finished_id;
+				actor_submit(cmd, NULL);
+			}
+			mpd_snapshot.finished_id = -1;
+		}
+	}
+
+	if (current_song != NULL)
+	{
+		// Anything?
+		if (track_duration == 0)
+		{
+			// See if we have the URI metadate (last resort)
+			long long ms = parse_upnp_time(transport_get_var(TRANSPORT_VAR_CUR_TRACK_DUR));
+
+			track_duration = (ms > 0) ? ms / 1000 : 0;
+		}
+		else
+		{
+			transport_set_number(TRANSPORT_VAR_CUR_TRACK_DUR, track_duration * 1000LL);
+		}
+
+		// Get current meta data
+		sval = transport_get_var(TRANSPORT_VAR_AV_URI);
+		if (!sval || (strcmp(sval, "") == 0))
+		{
+			sval = mpd_song_get_uri(current_song);
+			if (sval)
+			{
+				// Set the current URI for track and transport
+				transport_set_var(TRANSPORT_VAR_CUR_TRACK_URI, (char *)sval);
+				transport_set_var(TRANSPORT_VAR_AV_URI, (char *)sval);
+
+				get_track_metadata(current_song);
+			}
+		}
+	}
+
+	// Queue size and total play time
+	transport_set_number(TRANSPORT_VAR_NR_TRACKS, mpd_snapshot.queue_length);
+	transport_set_number(TRANSPORT_VAR_CUR_MEDIA_DUR, mpd_snapshot.queue_duration * 1000LL);
+
+	// MPD state update
+	output_translate_state();
+	output_translate_playmode();
+
+	// and track position
+	update_track_position();
+
+	ithread_mutex_unlock(&status_mutex);
+
+	return;
+}
+
+// Run a command on the actor, publish fresh status if it asked for it
+// Note: caller must hold transport_mutex for status commands
+DBG_STATIC int output_command(struct mpd_command *cmd)
+{
+	int rc;
+
+	rc = actor_call(cmd);
+	if ((rc == 0) && cmd->want_status)
+		publish_status();
+
+	return rc;
+}
+
+void output_set_uri(const char *uri)
+{
+	struct mpd_command *cmd;
+
+	DBG_PRINT(DBG_LVL1, "%s: setting MPD uri to '%s'\n", __FUNCTION__, uri);
+
+	if (check_mpd_connection() != STATUS_OK)
+		return;
+
+	ithread_mutex_lock(&stage_mutex);
+
+	free(stage_take());
+	uri_stage.stamp = monotonic_ms();
+	uri_stage.unplayed = true;
+
+	if (options_uri_hold < 0)
+	{
+		// Nothing to wait for - a following Play is queued behind it
+		cmd = command_new(MPD_CMD_SET_URI, uri);
+		if (cmd)
+			actor_submit(cmd, NULL);
+	}
+	else
+	{
+		// Hold it - Play usually follows right away and both go out together
+		uri_stage.uri = strdup(uri);
+		uri_stage.timer = g_timeout_add(options_uri_hold, stage_expired,
+						GUINT_TO_POINTER(uri_stage.serial));
+	}
+
+	ithread_mutex_unlock(&stage_mutex);
+
+	return;
+}
+
+// Queue the track to follow the current one (gapless)
+int output_set_next_uri(const char *uri)
+{
+	struct mpd_command cmd = { .type = MPD_CMD_SET_NEXT, .uri = uri };
+
+	DBG_PRINT(DBG_LVL1, "%s: queueing MPD uri '%s'\n", __FUNCTION__, uri);
+
+	// Return success if test mode enabled
+	if (test_mode)
+		return 0;
+
+	if (actor_call(&cmd) != 0)
+		return -1;
+
+	DBG_PRINT(DBG_LVL2, "Next song id %d\n", cmd.song_id);
+
+	return 0;
+}
+
+int output_play(void)
+{
+	struct mpd_command cmd = { .type = MPD_CMD_PLAY, .want_status = true };
+	struct mpd_future future;
+	long long stamp = 0;
+	char *uri;
+	int rc;
+
+	// Return success if test mode enabled
+	if (test_mode)
+		return 0;
+
+	if (check_mpd_connection() != STATUS_OK)
+		return -1;
+
+	// Fuse with a held URI: clear, addid and play in one round trip
+	ithread_mutex_lock(&stage_mutex);
+
+	uri = stage_take();
+	if (uri)
+	{
+		cmd.type = MPD_CMD_PLAY_URI;
+		cmd.uri = uri;
+	}
+	if (uri_stage.unplayed)
+		stamp = uri_stage.stamp;
+	uri_stage.unplayed = false;
+	actor_submit(&cmd, &future);
+
+	ithread_mutex_unlock(&stage_mutex);
+
+	rc = future_wait(&future);
+
+	// First Play after SetAVTransportURI - time to start
+	if ((rc == 0) && (stamp != 0))
+	{
+		stamp = monotonic_ms() - stamp;
+		DBG_PRINT(DBG_LVL1, "SetAVTransportURI to playing: %lld msecs (%s)\n",
+			  stamp, (uri) ? "fused" : "separate");
+
+		ithread_mutex_lock(&stage_mutex);
+		start_stats_add((uri) ? &start_stats.fused : &start_stats.separate, stamp);
+		ithread_mutex_unlock(&stage_mutex);
+	}
+
+	if (uri)
+		free(uri);
+
+	if (rc == 0)
+		publish_status();
+
+	return rc;
+}
+
+int output_stop(void)
+{
+	struct mpd_command cmd = { .type = MPD_CMD_STOP, .want_status = true };
+
+	// Return success if test mode enabled
+	if (test_mode)
+		return 0;
+
+	return output_command(&cmd);
+}
+
+int output_pause(void)
+{
+	struct mpd_command cmd = { .type = MPD_CMD_PAUSE, .want_status = true };
+
+	// Return success if test mode enabled
+	if (test_mode)
+		return 0;
+
+	return output_command(&cmd);
+}
+
+int output_next(void)
+{
+	struct mpd_command cmd = { .type = MPD_CMD_NEXT, .want_status = true };
+
+	// Return success if test mode enabled
+	if (test_mode)
+		return 0;
+
+	return output_command(&cmd);
+}
+
+int output_prev(void)
+{
+	struct mpd_command cmd = { .type = MPD_CMD_PREV, .want_status = true };
+
+	// Return success if test mode enabled
+	if (test_mode)
+		return 0;
+
+	return output_command(&cmd);
+}
+
+int output_seekto(const char *seekmode, const char *seekpos)
+{
+	struct mpd_command cmd = { .want_status = true };
+	enum mpd_state state = MPD_STATE_UNKNOWN;
+	long long target, duration, queue_duration;
+	unsigned queue_length;
+	bool queue_open;
+
+	// Return success if test mode enabled
+	if (test_mode)
+		return 0;
+
+	// Refuse early if we know the player is stopped
+	ithread_mutex_lock(&status_mutex);
+	if (snapshot_fresh())
+		state = mpd_snapshot.state;
+	duration = track_duration * 1000LL;
+	// Seeks are acknowledged before MPD sees them - check the target here
+	queue_length = mpd_snapshot.queue_length;
+	queue_duration = mpd_snapshot.queue_duration * 1000LL;
+	queue_open = mpd_snapshot.queue_open;
+	ithread_mutex_unlock(&status_mutex);
+
+	if (state == MPD_STATE_STOP)
+	{
+		DBG_PRINT(DBG_LVL1, "Player stopped -- cannot seek\n");
+		return -1;
+	}
+
+	if (strcmp(seekmode, "TRACK_NR") == 0)
+	{
+		unsigned track = strtoul(seekpos, NULL, 10);
+
+		// Track numbers are 1-based positions in the queue
+		if ((track < 1) || (track > queue_length))
+		{
+			DBG_PRINT(DBG_LVL1, "Track %u not in queue (%u)\n", track, queue_length);
+			return -1;
+		}
 
-	if (!mpd_run_seek_id(mpd_conn, sid, seekto))
+		// Start of selected track
+		cmd.type = MPD_CMD_SEEK_POS;
+		cmd.arg = track - 1;
+		cmd.pos = 0;
+	}
+	else if ((strcmp(seekmode, "REL_TIME") == 0) || (strcmp(seekmode, "ABS_TIME") == 0))
 	{
-		if (mpd_connection_get_error(mpd_conn) == MPD_ERROR_SERVER)
+		target = parse_upnp_time(seekpos);
+		if (target < 0)
+		{
+			DBG_PRINT(DBG_LVL1, "Bad seek target '%s'\n", seekpos);
+			return -1;
+		}
+
+		if (seekmode[0] == 'R')
 		{
-			/* we've got an error message from the server */
-			const char *message = mpd_connection_get_error_message(mpd_conn);
-			//message = charset_from_utf8(message);
-			fprintf(stderr, "error seeking stream - %s\n", message);
+			// Position within the current track
+			if ((duration > 0) && (target > duration))
+				target = duration;
+			cmd.type = MPD_CMD_SEEK_CUR;
 		}
 		else
 		{
-			output_printError(__FUNCTION__);
+			// Position within the whole queue
+			if (!queue_open && (target >= queue_duration))
+			{
+				DBG_PRINT(DBG_LVL1, "Seek target beyond end of queue\n");
+				return -1;
+			}
+			cmd.type = MPD_CMD_SEEK_ABS;
 		}
-		// Return error
-		rc = -1;
+
+		cmd.pos = target / 1000.0f;
 	}
 	else
-	{
-		// OK - update status
-		update_mpd_status();
-	}
+		return -1;
 
-	ithread_mutex_unlock(&mpd_mutex);
+	DBG_PRINT(DBG_LVL4, "Seeking (%s) to: %.3f in %lld\n", seekmode, cmd.pos, duration);
 
-	return rc;
+	// Scrubbing sends bursts - only the latest target matters
+	coalesce_submit(&seek_slot, &cmd);
+
+	// Position extrapolation is off until MPD reports back
+	output_invalidate_status();
+
+	return 0;
 }
 
 int output_playmode(const char *newmode)
 {
-	int rc = 0;
+	struct mpd_command cmd = { .type = MPD_CMD_PLAYMODE };
 
 	// Return success if test mode enabled
 	if (test_mode)
 		return 0;
 
-	ithread_mutex_lock(&mpd_mutex);
-
 	if (strcmp(newmode, "NORMAL") == 0)
 	{
-		if (!mpd_command_list_begin(mpd_conn, FALSE) ||
-				!mpd_send_single(mpd_conn, FALSE) ||
-				!mpd_send_random(mpd_conn, FALSE) ||
-				!mpd_send_repeat(mpd_conn, FALSE) ||
-				!mpd_command_list_end(mpd_conn))
-		{
-			mpd_response_finish(mpd_conn);
-			output_printError(__FUNCTION__);
-			rc = -1;
-			goto out;
-		}
-
+		cmd.single = false;
+		cmd.random = false;
+		cmd.repeat = false;
 	}
 	else if (strcmp(newmode, "REPEAT-ONE") == 0)
 	{
-		if (!mpd_command_list_begin(mpd_conn, FALSE) ||
-				!mpd_send_single(mpd_conn, TRUE) ||
-				!mpd_send_random(mpd_conn, FALSE) ||
-				!mpd_send_repeat(mpd_conn, TRUE) ||
-				!mpd_command_list_end(mpd_conn))
-		{
-			mpd_response_finish(mpd_conn);
-			output_printError(__FUNCTION__);
-			rc = -1;
-			goto out;
-		}
+		cmd.single = true;
+		cmd.random = false;
+		cmd.repeat = true;
 	}
 	else if (strcmp(newmode, "DIRECT_1") == 0)
 	{
-		if (!mpd_command_list_begin(mpd_conn, FALSE) ||
-				!mpd_send_single(mpd_conn, TRUE) ||
-				!mpd_send_random(mpd_conn, FALSE) ||
-				!mpd_send_repeat(mpd_conn, FALSE) ||
-				!mpd_command_list_end(mpd_conn))
-		{
-			mpd_response_finish(mpd_conn);
-			output_printError(__FUNCTION__);
-			rc = -1;
-			goto out;
-		}
+		cmd.single = true;
+		cmd.random = false;
+		cmd.repeat = false;
 	}
 	else if (strcmp(newmode, "REPEAT-ALL") == 0)
 	{
-		if (!mpd_command_list_begin(mpd_conn, FALSE) ||
-				!mpd_send_single(mpd_conn, FALSE) ||
-				!mpd_send_random(mpd_conn, FALSE) ||
-				!mpd_send_repeat(mpd_conn, TRUE) ||
-				!mpd_command_list_end(mpd_conn))
-		{
-			mpd_response_finish(mpd_conn);
-			output_printError(__FUNCTION__);
-			rc = -1;
-			goto out;
-		}
+		cmd.single = false;
+		cmd.random = false;
+		cmd.repeat = true;
 	}
 	else if (strcmp(newmode, "RANDOM") == 0)
 	{
-		if (!mpd_command_list_begin(mpd_conn, FALSE) ||
-				!mpd_send_single(mpd_conn, FALSE) ||
-				!mpd_send_random(mpd_conn, TRUE) ||
-				!mpd_send_repeat(mpd_conn, FALSE) ||
-				!mpd_command_list_end(mpd_conn))
-		{
-			mpd_response_finish(mpd_conn);
-			output_printError(__FUNCTION__);
-			rc = -1;
-			goto out;
-		}
+		cmd.single = false;
+		cmd.random = true;
+		cmd.repeat = false;
 	}
 	else
-		rc = -1;
-
-out:
-	// Cleanup if success
-	if (rc == 0)
-	{
-		if (!mpd_response_finish(mpd_conn))
-			output_printError(__FUNCTION__);
-	}
-
-	ithread_mutex_unlock(&mpd_mutex);
+		return -1;
 
-	return rc;
+	return actor_call(&cmd);
 }
 
-void output_set_volume(const char *newvol)
+void output_set_volume(long long newvol)
 {
+	struct mpd_command cmd = { .type = MPD_CMD_VOLUME };
 	int val;
 
 	// Return success if test mode enabled
@@ -604,51 +2165,35 @@ void output_set_volume(const char *newvol)
 		return;
 
 	// Validate input request (0-100)
-	if (!newvol)
-		return;
-
-	val = atoi(newvol);
-	if (val < 0)
-		val = 0;
-	if (val > 100)
-		val = 100;
+	if (newvol < 0)
+		newvol = 0;
+	if (newvol > 100)
+		newvol = 100;
+	val = newvol;
 
-	ithread_mutex_lock(&mpd_mutex);
-
-	if (!mpd_run_set_volume(mpd_conn, val))
-	{
-		if (mpd_connection_get_error(mpd_conn) == MPD_ERROR_SERVER)
-		{
-			/* we've got an error message from the server */
-			const char *message = mpd_connection_get_error_message(mpd_conn);
-			//message = charset_from_utf8(message);
-			fprintf(stderr, "error setting volume - %s\n", message);
-		}
-		else
-		{
-			output_printError(__FUNCTION__);
-		}
-	}
-	else
-	{
-		// Keep local copy of volume
-		mpdvolume = val;
-		mutevolume = val;
-	}
+	// Keep local copy of volume (answers queries right away)
+	ithread_mutex_lock(&status_mutex);
+	mpdvolume = val;
+	mutevolume = val;
+	ithread_mutex_unlock(&status_mutex);
 
-	ithread_mutex_unlock(&mpd_mutex);
+	cmd.arg = val;
+	coalesce_submit(&volume_slot, &cmd);
 
 	return;
 }
 
 void output_set_mute(bool bmute)
 {
+	struct mpd_command cmd = { .type = MPD_CMD_VOLUME };
 	int newvolume;
 
 	// Return success if test mode enabled
 	if (test_mode)
 		return;
 
+	ithread_mutex_lock(&status_mutex);
+
 	if (bmute)
 	{
 		// Save current volume for restore
@@ -660,350 +2205,77 @@ void output_set_mute(bool bmute)
 		// Restore volume
 		newvolume = mutevolume;
 	}
+	mpdvolume = newvolume;
 
-	ithread_mutex_lock(&mpd_mutex);
-
-	if (!mpd_run_set_volume(mpd_conn, newvolume))
-	{
-		if (mpd_connection_get_error(mpd_conn) == MPD_ERROR_SERVER)
-		{
-			/* we've got an error message from the server */
-			const char *message = mpd_connection_get_error_message(mpd_conn);
-			//message = charset_from_utf8(message);
-			fprintf(stderr, "error setting volume - %s\n", message);
-		}
-		else
-		{
-			output_printError(__FUNCTION__);
-		}
-	}
-	else
-	{
-		mpdvolume = newvolume;
-	}
+	ithread_mutex_unlock(&status_mutex);
 
-	ithread_mutex_unlock(&mpd_mutex);
+	// Shares the slot with SetVolume - latest wins
+	cmd.arg = newvolume;
+	coalesce_submit(&volume_slot, &cmd);
 
 	return;
 }
 
-const char *output_get_volume(void)
+int output_get_volume(void)
 {
-	snprintf(tempbuf, 6, "%d", mpdvolume);
-
-	return (const char *)tempbuf;
+	return mpdvolume;
 }
 
-/*************************************************************
- *  DIDL-LITE metadata short-form template for MPD ID3 tags  *
- *************************************************************/
-
-#define DIDL_LITE_TEMPLATE  \
-    "<DIDL-Lite xmlns=\"urn:schemas-upnp-org:metadata-1-0/DIDL-Lite/\" " \
-        "xmlns:upnp=\"urn:schemas-upnp-org:metadata-1-0/upnp/\" " \
-        "xmlns:dc=\"http://purl.org/dc/elements/1.1/\" " \
-       "xmlns:dlna=\"urn:schemas-dlna-org:metadata-1-0/\">" \
-            "<item id=\"xyzzy$1$0\" parentID=\"xyzzy$1\" restricted=\"1\">" \
-                "<upnp:class>object.item.audioItem.musicTrack</upnp:class>" \
-                "<dc:title>%s</dc:title>" \
-                "<upnp:album>%s</upnp:album>" \
-                "<upnp:artist>%s</upnp:artist>" \
-                "<upnp:originalTrackNumber>%s</upnp:originalTrackNumber>" \
-                "<dc:date>%s</dc:date>" \
-                "<res protocolInfo=\"http-get:*:audio/mpeg:DLNA.ORG_PN=MP3\" duration=\"%s\"> %s</res>" \
-            "</item>" \
-    "</DIDL-Lite>"
-
-DBG_STATIC const char *get_song_tag(struct mpd_song *song, const char *tag)
+void output_update_status(void)
 {
-	const char *sval;
-	enum mpd_tag_type tag_type;
-
-	// Find ID3 tag values from song data
-	tag_type = mpd_tag_name_iparse(tag);
-	if (tag_type != MPD_TAG_UNKNOWN)
-	{
-		sval = mpd_song_get_tag(song, tag_type, 0);
-		if (sval)
-		{
-			DBG_PRINT(DBG_LVL4, "ID3 tag found %s = %s\n", tag, sval);
-			return sval;
-		}
-	}
-	// Not found
-	return NULL;
-}
+	struct mpd_command cmd = { .type = MPD_CMD_STATUS, .want_status = true };
 
-DBG_STATIC void get_track_metadata(struct mpd_song *song)
-{
-	char *sval;
-	const char *mtitle, *malbum, *martist, *mtrack, *mdate, *mname;
+	if (test_mode)
+		return;
 
-	// Get current meta data
-	sval = transport_get_var(TRANSPORT_VAR_AV_URI_META);
-	if (!sval || (strcmp(sval, "") == 0))
-	{
-		// Empty metadata - Do we also have a URI
-		sval = transport_get_var(TRANSPORT_VAR_AV_URI);
-		if (sval && (strcmp(sval, "") != 0))
-		{
-			// We have URI - make up some metadata
-			mtitle = get_song_tag(song, "title");
-			malbum = get_song_tag(song, "album");
-			martist = get_song_tag(song, "artist");
-			mtrack = get_song_tag(song, "track");
-			mdate = get_song_tag(song, "date");
-			mname = get_song_tag(song, "name");
-
-			// Must have a title or name
-			if (mtitle || mname)
-			{
-				// Default "name" (if needed)
-				if (!mname)
-					mname = "Unknown";
-
-				// Use 'name' if no title or album
-				if (!mtitle)
-					mtitle = mname;
-				else if (!malbum)
-					malbum = mname;
-
-				// Fill in some defaults
-				if (!malbum)
-					malbum = "Unknown";
-				if (!martist)
-					martist = "Unknown";
-				if (!mtrack)
-					mtrack = "1";
-				if (!mdate)
-					mdate = "1980-01-01T00:00:00";
-
-				// Convert ID3 tags to UPnP DCS <DIDL-Lite\>
-				asprintf(&sval,
-					 DIDL_LITE_TEMPLATE,
-					 mtitle, malbum, martist, mtrack, mdate,
-					 transport_get_var(TRANSPORT_VAR_CUR_TRACK_DUR),
-					 transport_get_var(TRANSPORT_VAR_AV_URI));
-
-				// Set track and transport metadata
-				transport_set_var(TRANSPORT_VAR_CUR_TRACK_META, sval);
-				transport_set_var(TRANSPORT_VAR_AV_URI_META, sval);
-
-				free(sval);
-			}
-		}
-	}
+	output_command(&cmd);
 
 	return;
 }
 
-// Note: caller must hold transport_mutex
-DBG_STATIC void update_track_position(struct mpd_status *mstatus)
+void output_update_position(void)
 {
-	char buf[16];
-	int val;
-	int hh, mm, ss;
-
-	// Track # (position in queue)
-	val = mpd_status_get_song_pos(mstatus);
-	snprintf(buf, 6, "%d", val + 1);
-	transport_set_var(TRANSPORT_VAR_CUR_TRACK, buf);
-
-	// play position (relative)
-	val = mpd_status_get_elapsed_time(mstatus);
-	snprintf(buf, 10, "%d", val);
-	transport_set_var(TRANSPORT_VAR_REL_CTR_POS, buf);
-	transport_set_var(TRANSPORT_VAR_ABS_CTR_POS, buf);
-
-	// Convert to hh:mm:ss
-	hh = val / 3600;
-	mm = (val - (hh * 3600)) / 60;
-	ss = val - (hh * 3600) - (mm * 60);
-	snprintf(buf, 10, "%02d:%02d:%02d", hh, mm, ss);
-	transport_set_var(TRANSPORT_VAR_REL_TIME_POS, buf);
-	transport_set_var(TRANSPORT_VAR_ABS_TIME_POS, buf);
+	struct mpd_command cmd = { .type = MPD_CMD_STATUS, .want_status = true };
 
-	return;
-}
-
-//
-// Translate MPD player to UPnP STATE value
-//
-DBG_STATIC void output_translate_state(struct mpd_status *mstatus)
-{
+	ithread_mutex_lock(&status_mutex);
 
-	switch(mpd_status_get_state(mstatus))
+	// Serve from the snapshot while it is fresh
+	if (snapshot_fresh())
 	{
-	case MPD_STATE_UNKNOWN:
-		// no information available
-		fprintf(stderr, "MPD state unknown\n");
-		break;
-
-	case MPD_STATE_STOP:
-		// not playing
-		transport_set_state(TRANSPORT_STOPPED, "STOPPED");
-		break;
+		update_track_position();
 
-	case MPD_STATE_PLAY:
-		// playing
-		transport_set_state(TRANSPORT_PLAYING, "PLAYING");
-		break;
-
-	case MPD_STATE_PAUSE:
-		// playing, but paused
-		transport_set_state(TRANSPORT_PAUSED_PLAYBACK, "PAUSED_PLAYBACK");
-		break;
+		ithread_mutex_unlock(&status_mutex);
+		return;
 	}
 
-	return;
-}
-
-// Note: caller must hold mpd_mutext
-DBG_STATIC void update_mpd_status(void)
-{
-	char buf[16];
-	struct mpd_status *mstatus;
-	struct mpd_song *song;
-	const char *sval;
-	int hh, mm, ss;
+	ithread_mutex_unlock(&status_mutex);
 
 	// Check MPD connection
-	if (!mpd_conn)
+	if (check_mpd_connection() != STATUS_OK)
 		return;
 
-
-	if (!mpd_command_list_begin(mpd_conn, true) ||
-			!mpd_send_status(mpd_conn) ||
-			!mpd_send_list_queue_meta(mpd_conn) ||
-			!mpd_command_list_end(mpd_conn))
-	{
-		output_printError(__FUNCTION__);
-		return;
-	}
-
-	mstatus = mpd_recv_status(mpd_conn);
-	if (mstatus == NULL)
-	{
-		mpd_response_finish(mpd_conn);
-		output_printError(__FUNCTION__);
-		return;
-	}
-
-	if (!mpd_response_next(mpd_conn))
-	{
-		mpd_response_finish(mpd_conn);
-		output_printError(__FUNCTION__);
-		mpd_status_free(mstatus);
+	if (actor_call(&cmd) != 0)
 		return;
-	}
-
-	song = mpd_recv_song(mpd_conn);
-	if (song != NULL)
-	{
-		// Song duration
-		track_duration = mpd_song_get_duration(song);
-		if (track_duration == 0)
-			track_duration = mpd_status_get_total_time(mstatus);
-		// Anything?
-		if (track_duration == 0)
-		{
-			// See if we have the URI metadate (last resort)
-			track_duration = parsetimetosecs(transport_get_var(TRANSPORT_VAR_CUR_TRACK_DUR));
-		}
-		else
-		{
-			// Convert track duration to hh:mm:ss
-			hh = track_duration / 3600;
-			mm = (track_duration - (hh * 3600)) / 60;
-			ss = track_duration - (hh * 3600) - (mm * 60);
-			snprintf(buf, 10, "%02d:%02d:%02d", hh, mm, ss);
-			transport_set_var(TRANSPORT_VAR_CUR_TRACK_DUR, buf);
-		}
-
-		// Get current meta data
-		sval = transport_get_var(TRANSPORT_VAR_AV_URI);
-		if (!sval || (strcmp(sval, "") == 0))
-		{
-			sval = mpd_song_get_uri(song);
-			if (sval)
-			{
-				// Set the current URI for track and transport
-				transport_set_var(TRANSPORT_VAR_CUR_TRACK_URI, (char *)sval);
-				transport_set_var(TRANSPORT_VAR_AV_URI, (char *)sval);
-
-				get_track_metadata(song);
-			}
-		}
-
-		// Release song data
-		mpd_song_free(song);
-	}
-
-	if (!mpd_response_finish(mpd_conn))
-		output_printError(__FUNCTION__);
-
-	// Current volume setting
-	mpdvolume = mpd_status_get_volume(mstatus);
 
-	// MPD state update
-	output_translate_state(mstatus);
-
-	// and track position
-	update_track_position(mstatus);
-
-	mpd_status_free(mstatus);
-
-	return;
-}
+	ithread_mutex_lock(&status_mutex);
 
-void output_update_status(void)
-{
-	ithread_mutex_lock(&mpd_mutex);
+	// Update player state
+	output_translate_state();
+	update_track_position();
 
-	update_mpd_status();
-
-	ithread_mutex_unlock(&mpd_mutex);
+	ithread_mutex_unlock(&status_mutex);
 
 	return;
 }
 
-void output_update_position(void)
+// Force the next position query to go to MPD
+void output_invalidate_status(void)
 {
-	struct mpd_status *mstatus;
-
-	// Check MPD connection
-	if (check_mpd_connection(FALSE) != STATUS_OK)
-		return;
+	ithread_mutex_lock(&status_mutex);
 
-	ithread_mutex_lock(&mpd_mutex);
-
-	mstatus = mpd_run_status(mpd_conn);
-	if (mstatus == NULL)
-	{
-		ithread_mutex_unlock(&mpd_mutex);
-		if (mpd_connection_get_error(mpd_conn) == MPD_ERROR_SERVER)
-		{
-			/* we've got an error message from the server */
-			const char *message = mpd_connection_get_error_message(mpd_conn);
-			//message = charset_from_utf8(message);
-			fprintf(stderr, "error getting status - %s\n", message);
-		}
-		else
-		{
-			output_printError(__FUNCTION__);
-		}
-	}
-	else
-	{
-		// Update player state
-		output_translate_state(mstatus);
-
-		update_track_position(mstatus);
-
-		mpd_status_free(mstatus);
-	}
+	mpd_snapshot.stamp = 0;
 
-	ithread_mutex_unlock(&mpd_mutex);
+	ithread_mutex_unlock(&status_mutex);
 
 	return;
 }
@@ -1018,6 +2290,18 @@ int output_loop()
 	/* Create a main loop that runs the default GLib main context */
 	loop = g_main_loop_new(NULL, FALSE);
 
+	// Monitor changes made by other MPD clients
+	if (!test_mode && (idle_setup() != 0))
+		g_timeout_add_seconds(IDLE_RETRY, idle_retry, NULL);
+
+	// Keep the command connection from timing out
+	if (!test_mode && (options_keepalive > 0))
+		g_timeout_add_seconds(options_keepalive, keepalive_check, NULL);
+
+	// Periodic statistics log
+	if (options_stats > 0)
+		g_timeout_add_seconds(options_stats, stats_report, NULL);
+
 	g_main_loop_run(loop);
 
 	return 0;
@@ -1044,6 +2328,22 @@ static GOptionEntry option_entries[] =
 		"timeout", 'T', 0, G_OPTION_ARG_INT, &options_mpd_timeout,
 		"MPD transaction timeout (secs) ", NULL
 	},
+	{
+		"status-ttl", 0, 0, G_OPTION_ARG_INT, &options_status_ttl,
+		"Max age of cached player status (msecs) ", NULL
+	},
+	{
+		"keepalive", 0, 0, G_OPTION_ARG_INT, &options_keepalive,
+		"MPD connection keepalive (secs, < 0 disables) ", NULL
+	},
+	{
+		"uri-hold", 0, 0, G_OPTION_ARG_INT, &options_uri_hold,
+		"Wait for Play after SetAVTransportURI (msecs, < 0 disables) ", NULL
+	},
+	{
+		"stats", 0, 0, G_OPTION_ARG_INT, &options_stats,
+		"Log statistics every n secs (0 disables) ", NULL
+	},
 	{
 		"testmode", 't', 0, G_OPTION_ARG_NONE, &test_mode,
 		"testmode - OK if no MPD", NULL
@@ -1104,14 +2404,50 @@ int output_mpd_init(config_t *cfg)
 		}
 	}
 
+	if (options_status_ttl == 0)
+	{
+		if (config_lookup_int(cfg, "status-ttl", (int *)&options_status_ttl) != CONFIG_TRUE)
+		{
+			options_status_ttl = STATUS_TTL_DEFAULT;
+		}
+	}
+
+	if (options_keepalive == 0)
+	{
+		if (config_lookup_int(cfg, "keepalive", (int *)&options_keepalive) != CONFIG_TRUE)
+		{
+			options_keepalive = KEEPALIVE_DEFAULT;
+		}
+	}
+
+	if (options_uri_hold == 0)
+	{
+		if (config_lookup_int(cfg, "uri-hold", (int *)&options_uri_hold) != CONFIG_TRUE)
+		{
+			options_uri_hold = URI_HOLD_DEFAULT;
+		}
+	}
+
+	if (options_stats == 0)
+		config_lookup_int(cfg, "stats", (int *)&options_stats);
+
 	if (options_password == NULL)
 		config_lookup_string(cfg, "password", (const char **)&options_password);
 
 
 	if (!test_mode)
 	{
+		struct mpd_command cmd = { .type = MPD_CMD_CONNECT };
+
+		// All MPD commands go through the actor thread
+		if (ithread_create(&actor_thread, NULL, actor_main, NULL) != 0)
+		{
+			fputs("MPD actor thread - create failed!\n", stderr);
+			return 1;
+		}
+
 		// Connect to MPD
-		if (setup_connection() == NULL)
+		if (actor_call(&cmd) != 0)
 			return 1;
 	}
 
@@ -35,13 +35,15 @@ int output_next(void);
 int output_prev(void);
 int output_playmode(const char *newmode);
 int output_seekto(const char *seekmode, const char *seekpos);
+int output_set_next_uri(const char *uri);
 
 void output_set_uri(const char *uri);
 void output_set_mute(bool bmute);
-void output_set_volume(const char *newvol);
+void output_set_volume(long long newvol);
 void output_update_status(void);
 void output_update_position(void);
-extern const char *output_get_volume(void);
+void output_invalidate_status(void);
+extern int output_get_volume(void);
 
 typedef enum
 {
@@ -50,6 +52,14 @@ typedef enum
 	STATUS_FAIL = 1
 } CNX_STATUS;
 
-CNX_STATUS check_mpd_connection(bool update_status);
+typedef enum
+{
+	MPD_CNX_DOWN,
+	MPD_CNX_CONNECTING,
+	MPD_CNX_UP
+} MPD_CNX_STATE;
+
+CNX_STATUS check_mpd_connection(void);
+MPD_CNX_STATE output_connection_state(void);
 
 #endif /*  _OUTPUT_MPD_H */
@@ -41,6 +41,7 @@
 
 #include "logging.h"
 
+#include "dispatch.h"
 #include "upnp.h"
 
 static const char *param_datatype_names[] =
@@ -353,6 +354,10 @@ struct service *find_service(struct device *device_def, char *service_name)
 {
 	struct service *event_service;
 	int serviceNum = 0;
+
+	if (device_def->service_table)
+		return dispatch_lookup(device_def->service_table, service_name);
+
 	while (event_service = device_def->services[serviceNum], event_service != NULL)
 	{
 		if (strcmp(event_service->service_name, service_name) == 0)
@@ -370,6 +375,9 @@ struct action *find_action(struct service *event_service, char *action_name)
 	if (event_service == NULL)
 		return NULL;
 
+	if (event_service->action_table)
+		return dispatch_lookup(event_service->action_table, action_name);
+
 	while (event_action =
 				&(event_service->actions[actionNum]),
 			event_action->action_name != NULL)
@@ -382,6 +390,65 @@ struct action *find_action(struct service *event_service, char *action_name)
 	return NULL;
 }
 
+// Compile service and action names into lookup tables
+// (find_service/find_action scan the arrays without them)
+int upnp_dispatch_init(struct device *device_def)
+{
+	struct service *srv;
+	const char **keys = NULL;
+	void **values = NULL;
+	int count, max = 0;
+	int result = -1;
+	int i, n;
+
+	// Largest table needed
+	for (i = 0; (srv = device_def->services[i]); i++)
+	{
+		for (n = 0; srv->actions[n].action_name; n++)
+			;
+		if (n > max)
+			max = n;
+	}
+	if (i > max)
+		max = i;
+	if (max == 0)
+		goto out;
+
+	keys = malloc(max * sizeof(char *));
+	values = malloc(max * sizeof(void *));
+	if ((keys == NULL) || (values == NULL))
+	{
+		fprintf(stderr, "%s: allocation failed\n", __FUNCTION__);
+		goto out;
+	}
+
+	for (count = 0; (srv = device_def->services[count]); count++)
+	{
+		for (n = 0; srv->actions[n].action_name; n++)
+		{
+			keys[n] = srv->actions[n].action_name;
+			values[n] = &srv->actions[n];
+		}
+		srv->action_table = dispatch_new(keys, values, n);
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		keys[i] = device_def->services[i]->service_name;
+		values[i] = device_def->services[i];
+	}
+	device_def->service_table = dispatch_new(keys, values, count);
+
+	result = 0;
+out:
+	if (keys)
+		free(keys);
+	if (values)
+		free(values);
+
+	return result;
+}
+
 char *upnp_get_scpd(struct service *srv)
 {
 	char *result = NULL;
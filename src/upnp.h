@@ -28,11 +28,20 @@
 struct action;
 struct service;
 struct action_event;
+struct propset;
+struct dispatch;
+struct response_cache;
+
+// Getter answered from service state only (no arguments besides
+// InstanceID) - its response is reused until some variable changes
+#define ACTION_CACHED	0x01
 
 struct action
 {
 	const char *action_name;
 	int (*callback) (struct action_event *);
+	int flags;
+	struct response_cache *cache;	// Last ACTION_CACHED response (upnp_device.c)
 };
 
 typedef enum
@@ -63,9 +72,32 @@ typedef enum
 typedef enum
 {
 	SENDEVENT_NO,
-	SENDEVENT_YES
+	SENDEVENT_YES,
+	SENDEVENT_LASTCHANGE,		// Evented through LastChange
+	SENDEVENT_LASTCHANGE_CH		// Evented through LastChange (Channel="Master")
 } param_event;
 
+typedef enum
+{
+	VARFMT_STRING,			// Kept as a string
+	VARFMT_NUMBER,			// Kept as an integer
+	VARFMT_TIME				// Kept as milliseconds, formatted HH:MM:SS
+} param_format;
+
+typedef enum
+{
+	VARNUM_UNSET,			// String value (if any) is current
+	VARNUM_STALE,			// Number changed, string not formatted yet
+	VARNUM_CURRENT			// String value is the formatted number
+} param_number_state;
+
+// Typed variable value - formatted into variable_values when read
+struct var_number
+{
+	long long value;
+	param_number_state state;
+};
+
 struct param_range
 {
 	long long min;
@@ -80,6 +112,8 @@ struct var_meta
 	const char      **allowed_values;
 	struct param_range      *allowed_range;
 	const char      *default_value;
+	param_format    format;
+	int             polled;		// Changes with every position update (not versioned)
 };
 
 
@@ -110,6 +144,7 @@ struct device
 	const char *presentation_url;
 	struct icon **icons;
 	struct service **services;
+	struct dispatch *service_table;	// ServiceID lookup (upnp_dispatch_init)
 };
 
 struct service
@@ -125,10 +160,25 @@ struct service
 	const char **variable_names;
 	char **variable_values;
 	const char **variable_defaults;
+	struct var_number *variable_numbers;	// Typed values (or NULL)
 	struct var_meta *variable_meta;
 	int variable_count;
 	int command_count;
 	int (*subscription_notify)(void);
+	unsigned int state_version;	// Bumped on every change of a non-polled variable (read atomically)
+	struct propset *initial_set;	// Escaped initial event (upnp_device.c)
+	struct dispatch *action_table;	// ActionName lookup (upnp_dispatch_init)
+};
+
+// Most IN arguments of any action
+#define ACTION_ARGS_MAX		8
+
+// IN arguments of a request, in argument list order (upnp_device.c)
+struct action_args
+{
+	struct argument **schema;
+	const char *values[ACTION_ARGS_MAX];	// Borrowed from the request document
+	long long numbers[ACTION_ARGS_MAX];		// Parsed integer and boolean arguments
 };
 
 struct action_event
@@ -136,12 +186,24 @@ struct action_event
 	struct Upnp_Action_Request *request;
 	int status;
 	struct service *service;
+	struct action_args args;
+};
+
+// Most OUT arguments answered by one upnp_append_variables()
+#define RESPONSE_VARS_MAX	16
+
+// OUT argument answered from a state variable (upnp_append_variables)
+struct response_var
+{
+	int varnum;
+	const char *name;
 };
 
 struct service *find_service(struct device *device_def,
 			     char *service_name);
 struct action *find_action(struct service *event_service,
 			   char *action_name);
+int upnp_dispatch_init(struct device *device_def);
 
 char *upnp_get_scpd(struct service *srv);
 char *upnp_get_device_desc(struct device *device_def);
@@ -37,6 +37,7 @@
 
 #include "logging.h"
 
+#include "value.h"
 #include "upnp.h"
 #include "upnp_device.h"
 #include "upnp_connmgr.h"
@@ -277,17 +278,27 @@ int connmgr_init(void)
 		*(--p) = '\0';
 	}
 
-	connmgr_values[CONNMGR_VAR_SINK_PROTO_INFO] = buf;
-	connmgr_values[CONNMGR_VAR_SRC_PROTO_INFO] = (char *)connmgr_defaults[CONNMGR_VAR_SRC_PROTO_INFO];
+	if (buf)
+	{
+		connmgr_values[CONNMGR_VAR_SINK_PROTO_INFO] = value_new(buf);
+		free(buf);
+	}
+	connmgr_values[CONNMGR_VAR_SRC_PROTO_INFO] = value_new(connmgr_defaults[CONNMGR_VAR_SRC_PROTO_INFO]);
 
 	return 0;
 }
 
 
+static const struct response_var protocol_info_vars[] =
+{
+	{ CONNMGR_VAR_SRC_PROTO_INFO, "Source" },
+	{ CONNMGR_VAR_SINK_PROTO_INFO, "Sink" },
+	{ 0, NULL }
+};
+
 DBG_STATIC int get_protocol_info(struct action_event *event)
 {
-	upnp_append_variable(event, CONNMGR_VAR_SRC_PROTO_INFO, "Source");
-	upnp_append_variable(event, CONNMGR_VAR_SINK_PROTO_INFO, "Sink");
+	upnp_append_variables(event, protocol_info_vars);
 
 	return event->status;
 }
@@ -308,46 +319,30 @@ DBG_STATIC int get_current_conn_ids(struct action_event *event)
 //	return 0;
 //}
 
+static const struct response_var conn_info_vars[] =
+{
+	{ CONNMGR_VAR_AAT_RCS_ID, "RcsID" },
+	{ CONNMGR_VAR_AAT_AVT_ID, "AVTransportID" },
+	{ CONNMGR_VAR_AAT_PROTO_INFO, "ProtocolInfo" },
+	{ CONNMGR_VAR_AAT_CONN_MGR, "PeerConnectionManager" },
+	{ CONNMGR_VAR_AAT_CONN_ID, "PeerConnectionID" },
+	{ CONNMGR_VAR_AAT_DIR, "Direction" },
+	{ CONNMGR_VAR_AAT_CONN_STATUS, "Status" },
+	{ 0, NULL }
+};
+
 DBG_STATIC int get_current_conn_info(struct action_event *event)
 {
 	int rc = -1;
-	char *value;
+	const char *value;
 
 	value = upnp_get_string(event, "ConnectionID");
 	if (value == NULL)
 		goto out;
 
 	DBG_PRINT(DBG_LVL5, "%s: ConnectionID='%s'\n", __FUNCTION__, value);
-	free(value);
-
-	rc = upnp_append_variable(event, CONNMGR_VAR_AAT_RCS_ID, "RcsID");
-	if (rc)
-		goto out;
 
-	rc = upnp_append_variable(event, CONNMGR_VAR_AAT_AVT_ID, "AVTransportID");
-	if (rc)
-		goto out;
-
-	rc = upnp_append_variable(event, CONNMGR_VAR_AAT_PROTO_INFO, "ProtocolInfo");
-	if (rc)
-		goto out;
-
-	rc = upnp_append_variable(event, CONNMGR_VAR_AAT_CONN_MGR, "PeerConnectionManager");
-	if (rc)
-		goto out;
-
-	rc = upnp_append_variable(event, CONNMGR_VAR_AAT_CONN_ID, "PeerConnectionID");
-	if (rc)
-		goto out;
-
-	rc = upnp_append_variable(event, CONNMGR_VAR_AAT_DIR, "Direction");
-	if (rc)
-		goto out;
-
-	rc = upnp_append_variable(event, CONNMGR_VAR_AAT_CONN_STATUS,
-				  "Status");
-	if (rc)
-		goto out;
+	rc = upnp_append_variables(event, conn_info_vars);
 
 out:
 	return rc;
@@ -356,7 +351,7 @@ out:
 
 static struct action connmgr_actions[] =
 {
-	[CONNMGR_CMD_GETPROTOCOLINFO] =		{"GetProtocolInfo", get_protocol_info},
+	[CONNMGR_CMD_GETPROTOCOLINFO] =		{"GetProtocolInfo", get_protocol_info, ACTION_CACHED},
 	[CONNMGR_CMD_GETCURRENTCONNECTIONIDS] =	{"GetCurrentConnectionIDs", get_current_conn_ids},
 	[CONNMGR_CMD_SETCURRENTCONNECTIONINFO] ={"GetCurrentConnectionInfo", get_current_conn_info},
 	//[CONNMGR_CMD_PREPAREFORCONNECTION] =	{"PrepareForConnection", prepare_for_connection}, /* optional */
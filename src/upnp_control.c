@@ -40,9 +40,11 @@
 #include "logging.h"
 
 #include "xmlescape.h"
+#include "value.h"
 #include "webserver.h"
 #include "upnp.h"
 #include "upnp_device.h"
+#include "upnp_event.h"
 #include "upnp_control.h"
 #include "output_mpd.h"
 
@@ -124,28 +126,28 @@ static struct param_range volume_db_range = { -32768, 32767, 0 };
 static struct var_meta control_var_meta[] =
 {
 	[CONTROL_VAR_LAST_CHANGE] =		    { SENDEVENT_YES, DATATYPE_STRING, NULL, NULL },
-	[CONTROL_VAR_PRESET_NAME_LIST] =	{ SENDEVENT_NO, DATATYPE_STRING, NULL, NULL },
+	[CONTROL_VAR_PRESET_NAME_LIST] =	{ SENDEVENT_LASTCHANGE, DATATYPE_STRING, NULL, NULL },
 	[CONTROL_VAR_AAT_CHANNEL] =		    { SENDEVENT_NO, DATATYPE_STRING, aat_channels, NULL },
 	[CONTROL_VAR_AAT_INSTANCE_ID] =		{ SENDEVENT_NO, DATATYPE_UI4, NULL, NULL },
 	[CONTROL_VAR_AAT_PRESET_NAME] =		{ SENDEVENT_NO, DATATYPE_STRING, aat_presetnames, NULL },
 #if defined(UPNP_VIDEO)
-	[CONTROL_VAR_BRIGHTNESS] =		{ SENDEVENT_NO, DATATYPE_UI2, NULL, &brightness_range },
-	[CONTROL_VAR_CONTRAST] =		{ SENDEVENT_NO, DATATYPE_UI2, NULL, &contrast_range },
-	[CONTROL_VAR_SHARPNESS] =		{ SENDEVENT_NO, DATATYPE_UI2, NULL, &sharpness_range },
-	[CONTROL_VAR_R_GAIN] =			{ SENDEVENT_NO, DATATYPE_UI2, NULL, &vid_gain_range },
-	[CONTROL_VAR_G_GAIN] =			{ SENDEVENT_NO, DATATYPE_UI2, NULL, &vid_gain_range },
-	[CONTROL_VAR_B_GAIN] =			{ SENDEVENT_NO, DATATYPE_UI2, NULL, &vid_gain_range },
-	[CONTROL_VAR_R_BLACK] =			{ SENDEVENT_NO, DATATYPE_UI2, NULL, &vid_black_range },
-	[CONTROL_VAR_G_BLACK] =			{ SENDEVENT_NO, DATATYPE_UI2, NULL, &vid_black_range },
-	[CONTROL_VAR_B_BLACK] =			{ SENDEVENT_NO, DATATYPE_UI2, NULL, &vid_black_range },
-	[CONTROL_VAR_COLOR_TEMP] =		{ SENDEVENT_NO, DATATYPE_UI2, NULL, &colortemp_range },
-	[CONTROL_VAR_HOR_KEYSTONE] =	{ SENDEVENT_NO, DATATYPE_I2, NULL, &keystone_range },
-	[CONTROL_VAR_VER_KEYSTONE] =	{ SENDEVENT_NO, DATATYPE_I2, NULL, &keystone_range },
+	[CONTROL_VAR_BRIGHTNESS] =		{ SENDEVENT_LASTCHANGE, DATATYPE_UI2, NULL, &brightness_range },
+	[CONTROL_VAR_CONTRAST] =		{ SENDEVENT_LASTCHANGE, DATATYPE_UI2, NULL, &contrast_range },
+	[CONTROL_VAR_SHARPNESS] =		{ SENDEVENT_LASTCHANGE, DATATYPE_UI2, NULL, &sharpness_range },
+	[CONTROL_VAR_R_GAIN] =			{ SENDEVENT_LASTCHANGE, DATATYPE_UI2, NULL, &vid_gain_range },
+	[CONTROL_VAR_G_GAIN] =			{ SENDEVENT_LASTCHANGE, DATATYPE_UI2, NULL, &vid_gain_range },
+	[CONTROL_VAR_B_GAIN] =			{ SENDEVENT_LASTCHANGE, DATATYPE_UI2, NULL, &vid_gain_range },
+	[CONTROL_VAR_R_BLACK] =			{ SENDEVENT_LASTCHANGE, DATATYPE_UI2, NULL, &vid_black_range },
+	[CONTROL_VAR_G_BLACK] =			{ SENDEVENT_LASTCHANGE, DATATYPE_UI2, NULL, &vid_black_range },
+	[CONTROL_VAR_B_BLACK] =			{ SENDEVENT_LASTCHANGE, DATATYPE_UI2, NULL, &vid_black_range },
+	[CONTROL_VAR_COLOR_TEMP] =		{ SENDEVENT_LASTCHANGE, DATATYPE_UI2, NULL, &colortemp_range },
+	[CONTROL_VAR_HOR_KEYSTONE] =	{ SENDEVENT_LASTCHANGE, DATATYPE_I2, NULL, &keystone_range },
+	[CONTROL_VAR_VER_KEYSTONE] =	{ SENDEVENT_LASTCHANGE, DATATYPE_I2, NULL, &keystone_range },
 #endif
-	[CONTROL_VAR_MUTE] =			{ SENDEVENT_NO, DATATYPE_BOOLEAN, NULL, NULL },
-	[CONTROL_VAR_VOLUME] =			{ SENDEVENT_NO, DATATYPE_UI2, NULL, &volume_range },
-	[CONTROL_VAR_VOLUME_DB] =		{ SENDEVENT_NO, DATATYPE_I2, NULL, &volume_db_range },
-	[CONTROL_VAR_LOUDNESS] =		{ SENDEVENT_NO, DATATYPE_BOOLEAN, NULL, NULL },
+	[CONTROL_VAR_MUTE] =			{ SENDEVENT_LASTCHANGE_CH, DATATYPE_BOOLEAN, NULL, NULL },
+	[CONTROL_VAR_VOLUME] =			{ SENDEVENT_LASTCHANGE_CH, DATATYPE_UI2, NULL, &volume_range, .format = VARFMT_NUMBER },
+	[CONTROL_VAR_VOLUME_DB] =		{ SENDEVENT_LASTCHANGE_CH, DATATYPE_I2, NULL, &volume_db_range },
+	[CONTROL_VAR_LOUDNESS] =		{ SENDEVENT_LASTCHANGE_CH, DATATYPE_BOOLEAN, NULL, NULL },
 	[CONTROL_VAR_UNKNOWN] =			{ SENDEVENT_NO, DATATYPE_UNKNOWN, NULL, NULL }
 };
 
@@ -178,10 +180,14 @@ static const char *control_defaults[] =
 };
 
 static char *control_values[sizeof(control_defaults) / sizeof(char *)];
+static struct var_number control_numbers[sizeof(control_defaults) / sizeof(char *)];
 
 // Control service mutex
 static ithread_mutex_t control_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+// Moderated LastChange eventing
+static struct lastchange *control_lastchange = NULL;
+
 static struct argument *arguments_list_presets[] =
 {
 	& (struct argument) { "InstanceID", PARAM_DIR_IN, CONTROL_VAR_AAT_INSTANCE_ID },
@@ -450,52 +456,36 @@ static struct argument **argument_list[] =
 	[CONTROL_CMD_UNKNOWN] =			NULL
 };
 
-DBG_STATIC void control_notify_lastchange(struct action_event *event, char *value)
+void control_set_var(int varnum, const char *value)
 {
-	const char *varnames[] =
-	{
-		"LastChange",
-		NULL
-	};
-	char *varvalues[] =
-	{
-		NULL, NULL
-	};
+	assert((varnum >= 0) && (varnum < CONTROL_VAR_UNKNOWN));
 
-	DBG_PRINT(DBG_LVL5, "RCS Event: '%s'\n", value);
-	varvalues[0] = xmlescape(value, 0);
+	if (value == NULL)
+		return;
 
-	if (control_values[CONTROL_VAR_LAST_CHANGE])
-		free(control_values[CONTROL_VAR_LAST_CHANGE]);
+	// String value replaces any typed one
+	control_numbers[varnum].state = VARNUM_UNSET;
 
-	control_values[CONTROL_VAR_LAST_CHANGE] = value;
-	UpnpNotify(device_handle, event->request->DevUDN,
-		   event->request->ServiceID,
-		   varnames, (const char **)varvalues, 1);
+	// Any change
+	if (!value_set(&control_values[varnum], value))
+		return;
 
-	free(varvalues[0]);
+	// Version change (evented with next LastChange)
+	lastchange_mark(control_lastchange, varnum);
 
 	return;
 }
 
-void control_set_var(int varnum, char *value)
+// Typed (numeric or time) variable, formatted when read
+void control_set_number(int varnum, long long number)
 {
 	assert((varnum >= 0) && (varnum < CONTROL_VAR_UNKNOWN));
 
-	if (value == NULL)
+	if (!value_set_number(&control_service, varnum, number))
 		return;
 
-	if (control_values[varnum])
-	{
-		// Any change
-		if (strcmp(control_values[varnum], value) == 0)
-			return;
-
-		// Free old value before saving new one
-		free(control_values[varnum]);
-	}
-
-	control_values[varnum] = strdup(value);
+	// Version change (evented with next LastChange)
+	lastchange_mark(control_lastchange, varnum);
 
 	return;
 }
@@ -504,37 +494,19 @@ char *control_get_var(int varnum)
 {
 	assert((varnum >= 0) && (varnum < CONTROL_VAR_UNKNOWN));
 
-	return control_values[varnum];
-}
-
-/* warning - does not lock service mutex */
-DBG_STATIC void control_change_var(struct action_event *event,
-				   int varnum, char *new_value)
-{
-	char *buf;
-
-	control_set_var(varnum, new_value);
-
-	asprintf(&buf,
-		 "<Event xmlns=\"urn:schemas-upnp-org:metadata-1-0/RCS/\">"
-		 "<InstanceID val=\"0\"><%s Channel=\"Master\" val=\"%s\"/></InstanceID></Event>",
-		 control_variables[varnum], control_values[varnum]);
-
-	control_notify_lastchange(event, buf);
-
-	return;
+	return value_get_var(&control_service, varnum);
 }
 
 DBG_STATIC void control_update_settings(void)
 {
-	const char *curvol;
+	int curvol;
 
 	// Get current volume state
 	curvol = output_get_volume();
 	// current volume setting
-	control_set_var(CONTROL_VAR_VOLUME, (char *)curvol);
+	control_set_number(CONTROL_VAR_VOLUME, curvol);
 	// Update mute setting also
-	if (*curvol == '0')
+	if (curvol == 0)
 	{
 		control_set_var(CONTROL_VAR_MUTE, "1");
 	}
@@ -546,27 +518,33 @@ DBG_STATIC void control_update_settings(void)
 	return;
 }
 
-DBG_STATIC int control_notify_subscription(void)
+// Event volume/mute changes made outside UPnP (MPD idle monitor)
+void control_notify_status(void)
 {
-	char *buf;
-
 	ithread_mutex_lock(&control_mutex);
 
+	// Changed variables are evented with the next LastChange
 	control_update_settings();
 
-	// Construct LastChange event
-	asprintf(&buf,
-		 "<Event xmlns=\"urn:schemas-upnp-org:metadata-1-0/RCS/\">"
-		 "<InstanceID val=\"0\"><%s Channel=\"Master\" val=\"%s\"/><%s Channel=\"Master\" val=\"%s\"/></InstanceID></Event>",
-		 control_variables[CONTROL_VAR_VOLUME], control_values[CONTROL_VAR_VOLUME],
-		 control_variables[CONTROL_VAR_MUTE], control_values[CONTROL_VAR_MUTE]);
+	ithread_mutex_unlock(&control_mutex);
+
+	return;
+}
+
+DBG_STATIC int control_notify_subscription(void)
+{
+	ithread_mutex_lock(&control_mutex);
+
+	control_update_settings();
 
-	control_set_var(CONTROL_VAR_LAST_CHANGE, buf);
+	// Initial event carries the full state
+	lastchange_store(control_lastchange, lastchange_build(control_lastchange, TRUE));
 
 	ithread_mutex_unlock(&control_mutex);
 
 	return 0;
 }
+
 DBG_STATIC int cmd_obtain_variable(struct action_event *event, int varnum, char *paramname)
 {
 	if(upnp_obtain_instanceid(event, NULL))
@@ -667,7 +645,7 @@ DBG_STATIC int get_mute(struct action_event *event)
 
 DBG_STATIC int set_mute(struct action_event *event)
 {
-	char *value;
+	long long mute;
 	int rc = 0;
 
 	if (upnp_obtain_instanceid(event, NULL))
@@ -676,28 +654,24 @@ DBG_STATIC int set_mute(struct action_event *event)
 		return -1;
 	}
 
-	value = upnp_get_string(event, "DesiredMute");
-	if (value == NULL)
+	// Boolean - checked when the request arrived
+	if (upnp_get_int(event, "DesiredMute", &mute) != 0)
 		return -1;
 
-	DBG_PRINT(DBG_LVL4, "%s: DesiredMute='%s'\n", __FUNCTION__, value);
+	DBG_PRINT(DBG_LVL4, "%s: DesiredMute=%lld\n", __FUNCTION__, mute);
 
 	ithread_mutex_lock(&control_mutex);
 
 	// Simulate mute function
-	if (strcmp(value, "1") == 0)
+	if (mute)
 		output_set_mute(TRUE);
-	else if (strcmp(value, "0") == 0)
+	else
 	{
 		output_set_mute(FALSE);
-		control_change_var(event, CONTROL_VAR_VOLUME, (char *)output_get_volume());
+		control_set_number(CONTROL_VAR_VOLUME, output_get_volume());
 	}
-	else
-		printf("Unknown mute option: %s\n", value);
-
-	control_change_var(event, CONTROL_VAR_MUTE, value);
 
-	free(value);
+	control_set_var(CONTROL_VAR_MUTE, (mute) ? "1" : "0");
 
 	ithread_mutex_unlock(&control_mutex);
 
@@ -708,7 +682,7 @@ DBG_STATIC int get_volume(struct action_event *event)
 {
 	ithread_mutex_lock(&control_mutex);
 
-	control_set_var(CONTROL_VAR_VOLUME, (char *)output_get_volume());
+	control_set_number(CONTROL_VAR_VOLUME, output_get_volume());
 
 	ithread_mutex_unlock(&control_mutex);
 	/* FIXME - Channel */
@@ -717,7 +691,7 @@ DBG_STATIC int get_volume(struct action_event *event)
 
 DBG_STATIC int set_volume(struct action_event *event)
 {
-	char *value;
+	long long volume;
 	int rc = 0;
 
 	if (upnp_obtain_instanceid(event, NULL))
@@ -726,23 +700,21 @@ DBG_STATIC int set_volume(struct action_event *event)
 		return -1;
 	}
 
-	value = upnp_get_string(event, "DesiredVolume");
-	if (value == NULL)
+	if (upnp_get_int(event, "DesiredVolume", &volume) != 0)
 		return -1;
 
 	ithread_mutex_lock(&control_mutex);
 
-	DBG_PRINT(DBG_LVL4, "%s: DesiredVolume='%s'\n", __FUNCTION__, value);
+	DBG_PRINT(DBG_LVL4, "%s: DesiredVolume=%lld\n", __FUNCTION__, volume);
 
-	// do the work
-	output_set_volume(value);
+	// do the work (MPD is updated at a bounded rate)
+	output_set_volume(volume);
 
-	control_change_var(event, CONTROL_VAR_VOLUME, value);
-
-	free(value);
+	// Answer from the desired (clamped) value
+	control_set_number(CONTROL_VAR_VOLUME, output_get_volume());
 
 	// Reset mute state
-	control_change_var(event, CONTROL_VAR_MUTE, "0");
+	control_set_var(CONTROL_VAR_MUTE, "0");
 
 	ithread_mutex_unlock(&control_mutex);
 
@@ -816,6 +788,7 @@ struct service control_service =
 	.action_arguments =	argument_list,
 	.variable_names =	control_variables,
 	.variable_values =	control_values,
+	.variable_numbers =	control_numbers,
 	.variable_defaults = control_defaults,
 	.variable_meta =	control_var_meta,
 	.variable_count =	CONTROL_VAR_UNKNOWN,
@@ -827,6 +800,11 @@ struct service control_service =
 void control_init(void)
 {
 	memset(control_values, 0, sizeof(control_values));
+	memset(control_numbers, 0, sizeof(control_numbers));
+
+	control_lastchange = lastchange_new(&control_service,
+					    "urn:schemas-upnp-org:metadata-1-0/RCS/",
+					    CONTROL_VAR_LAST_CHANGE);
 
 	return;
 }
@@ -137,7 +137,9 @@ struct action_event;
 extern struct service control_service;
 
 extern void control_init(void);
-extern void control_set_var(int varnum, char *value);
+extern void control_set_var(int varnum, const char *value);
+extern void control_set_number(int varnum, long long number);
 extern char *control_get_var(int varnum);
+extern void control_notify_status(void);
 
 #endif /* _UPNP_CONTROL_H */
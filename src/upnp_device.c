@@ -46,25 +46,43 @@
 #include "logging.h"
 
 #include "xmlescape.h"
+#include "value.h"
 #include "webserver.h"
 #include "upnp.h"
 #include "upnp_device.h"
 
+// Initial event property set of a service, escaped and ready to send
+struct propset
+{
+	unsigned int version;	// Service state version it was built from
+	int count;
+	const char **names;
+	char **values;
+};
+
+// Response document of an ACTION_CACHED getter and the state version
+// it shows. libupnp frees the document it is handed, so every hit gets
+// a clone. The mutex is held only to clone or replace the document
+// (never with the service mutex) - the version check needs no lock.
+struct response_cache
+{
+	ithread_mutex_t mutex;
+	unsigned int version;
+	IXML_Document *doc;
+};
+
 UpnpDevice_Handle device_handle;
 
 static struct device *upnp_device;
 
-DBG_STATIC const char *get_service_var(struct service *srv, int varnum)
+// 'value' is the current value of the variable (or NULL)
+DBG_STATIC const char *get_service_value(struct service *srv, int varnum, const char *value)
 {
-	char *val = NULL;
-	if (srv->variable_values[varnum] != NULL)
-	{
-		val = srv->variable_values[varnum];
-	}
-	else
+	const char *val = value;
+	if (val == NULL)
 	{
 		if ((srv->variable_defaults != NULL) && (srv->variable_defaults[varnum] != NULL))
-			val = (char *)srv->variable_defaults[varnum];
+			val = srv->variable_defaults[varnum];
 	}
 
 	if (val == NULL)
@@ -78,6 +96,12 @@ DBG_STATIC const char *get_service_var(struct service *srv, int varnum)
 	return val;
 }
 
+// Note: caller must hold service mutex
+DBG_STATIC const char *get_service_var(struct service *srv, int varnum)
+{
+	return get_service_value(srv, varnum, value_get_var(srv, varnum));
+}
+
 int
 upnp_add_response(struct action_event *event, char *key, const char *value)
 {
@@ -106,37 +130,74 @@ out:
 	return result;
 }
 
-int upnp_append_variable(struct action_event *event, int varnum, char *paramname)
+// Answer with several variables taken from one consistent state
+// The values are referenced under a single lock and the response is
+// built after it is dropped
+int upnp_append_variables(struct action_event *event, const struct response_var *vars)
 {
-	const char *value;
 	struct service *service = event->service;
-	int retval = -1;
+	const char *value;
+	char *held[RESPONSE_VARS_MAX];
+	int retval = 0;
+	int count, i;
 
-	if (varnum >= service->variable_count)
+	for (count = 0; vars[count].name; count++)
 	{
-		upnp_set_error(event, UPNP_E_INTERNAL_ERROR,
-			       "Internal Error - illegal variable number %d",
-			       varnum);
-		goto out;
+		if (count == RESPONSE_VARS_MAX)
+		{
+			upnp_set_error(event, UPNP_E_INTERNAL_ERROR,
+				       "Internal Error - too many variables");
+			return -1;
+		}
+		if ((vars[count].varnum < 0) || (vars[count].varnum >= service->variable_count))
+		{
+			upnp_set_error(event, UPNP_E_INTERNAL_ERROR,
+				       "Internal Error - illegal variable number %d",
+				       vars[count].varnum);
+			return -1;
+		}
 	}
 
 	ithread_mutex_lock(service->service_mutex);
+	for (i = 0; i < count; i++)
+		held[i] = value_ref(value_get_var(service, vars[i].varnum));
+	ithread_mutex_unlock(service->service_mutex);
 
-	value = get_service_var(service, varnum);
-	if (value == NULL)
-	{
-		upnp_set_error(event, UPNP_E_INTERNAL_ERROR, "Internal Error");
-	}
-	else
+	for (i = 0; (i < count) && (retval == 0); i++)
 	{
-		retval = upnp_add_response(event, paramname, value);
+		value = get_service_value(service, vars[i].varnum, held[i]);
+		retval = upnp_add_response(event, (char *)vars[i].name, value);
 	}
 
-	ithread_mutex_unlock(service->service_mutex);
-out:
+	for (i = 0; i < count; i++)
+		value_unref(held[i]);
+
 	return retval;
 }
 
+int upnp_append_variable(struct action_event *event, int varnum, char *paramname)
+{
+	const struct response_var vars[] =
+	{
+		{ varnum, paramname },
+		{ 0, NULL }
+	};
+
+	return upnp_append_variables(event, vars);
+}
+
+// Send event to all subscribers of a service
+int upnp_device_notify(struct service *srv, const char **varnames,
+		       const char **varvalues, int varcount)
+{
+	// Not registered yet
+	if (upnp_device == NULL)
+		return -1;
+
+	return UpnpNotify(device_handle, upnp_device->udn, srv->service_name,
+			  varnames, varvalues, varcount);
+}
+
 void
 upnp_set_error(struct action_event *event, int error_code, const char *format, ...)
 {
@@ -153,78 +214,311 @@ upnp_set_error(struct action_event *event, int error_code, const char *format, .
 }
 
 
-char *upnp_get_string(struct action_event *event, const char *key)
+// Parse an integer or boolean argument by its state variable type
+// Returns -1 if the text is not a valid value of that type
+DBG_STATIC int upnp_parse_arg(param_datatype datatype, const char *text, long long *number)
 {
-	IXML_Node *node;
+	char *end;
 
-	node = (IXML_Node *) event->request->ActionRequest;
-	if (node == NULL)
+	switch (datatype)
 	{
-		upnp_set_error(event, UPNP_SOAP_E_INVALID_ARGS,
-			       "Invalid action request document");
-		return NULL;
+	case DATATYPE_BOOLEAN:
+		if ((strcmp(text, "1") == 0) || (strcasecmp(text, "true") == 0) ||
+		    (strcasecmp(text, "yes") == 0))
+			*number = 1;
+		else if ((strcmp(text, "0") == 0) || (strcasecmp(text, "false") == 0) ||
+			 (strcasecmp(text, "no") == 0))
+			*number = 0;
+		else
+			return -1;
+		break;
+
+	case DATATYPE_I2:
+	case DATATYPE_I4:
+	case DATATYPE_UI2:
+	case DATATYPE_UI4:
+		*number = strtoll(text, &end, 10);
+		if ((end == text) || (*end != '\0'))
+			return -1;
+		if ((*number < 0) && ((datatype == DATATYPE_UI2) || (datatype == DATATYPE_UI4)))
+			return -1;
+		break;
+
+	default:
+		*number = 0;
+		break;
 	}
 
-	node = ixmlNode_getFirstChild(node);
-	if (node == NULL)
+	return 0;
+}
+
+// Walk the request document once, collecting and checking all IN arguments
+DBG_STATIC int upnp_extract_args(struct action_event *event, struct argument **schema)
+{
+	struct action_args *args = &event->args;
+	struct var_meta *meta;
+	IXML_Node *node, *value;
+	const char *name;
+	int i, n;
+
+	memset(args, 0, sizeof(struct action_args));
+	args->schema = schema;
+	if (schema == NULL)
+		return 0;
+
+	node = (IXML_Node *) event->request->ActionRequest;
+	if ((node == NULL) || ((node = ixmlNode_getFirstChild(node)) == NULL))
 	{
 		upnp_set_error(event, UPNP_SOAP_E_INVALID_ARGS,
 			       "Invalid action request document");
-		return NULL;
+		return -1;
 	}
-	node = ixmlNode_getFirstChild(node);
 
-	for (; node != NULL; node = ixmlNode_getNextSibling(node))
+	for (node = ixmlNode_getFirstChild(node); node != NULL; node = ixmlNode_getNextSibling(node))
 	{
-		if (strcmp(ixmlNode_getNodeName(node), key) == 0)
+		name = ixmlNode_getNodeName(node);
+
+		for (i = 0, n = 0; schema[i] && (n < ACTION_ARGS_MAX); i++)
 		{
-			node = ixmlNode_getFirstChild(node);
-			if (node == NULL)
+			if (schema[i]->direction != PARAM_DIR_IN)
+				continue;
+
+			if (strcmp(schema[i]->name, name) == 0)
 			{
 				/* Are we sure empty arguments are reported like this? */
-				return strdup("");
+				value = ixmlNode_getFirstChild(node);
+				args->values[n] = (value) ? ixmlNode_getNodeValue(value) : "";
+				break;
 			}
-			return strdup(ixmlNode_getNodeValue(node));
+			n++;
 		}
 	}
 
-	upnp_set_error(event, UPNP_SOAP_E_INVALID_ARGS,
-		       "Missing action request argument (%s)", key);
-	return NULL;
+	// All arguments present and well formed
+	for (i = 0, n = 0; schema[i] && (n < ACTION_ARGS_MAX); i++)
+	{
+		if (schema[i]->direction != PARAM_DIR_IN)
+			continue;
+
+		if (args->values[n] == NULL)
+		{
+			upnp_set_error(event, UPNP_SOAP_E_INVALID_ARGS,
+				       "Missing action request argument (%s)", schema[i]->name);
+			return -1;
+		}
+
+		meta = &event->service->variable_meta[schema[i]->statevar];
+		if (upnp_parse_arg(meta->datatype, args->values[n], &args->numbers[n]) != 0)
+		{
+			upnp_set_error(event, UPNP_SOAP_E_INVALID_ARGS,
+				       "Invalid action request argument (%s)", schema[i]->name);
+			return -1;
+		}
+		n++;
+	}
+
+	return 0;
+}
+
+// Position of an IN argument in event->args (or -1)
+DBG_STATIC int upnp_find_arg(struct action_event *event, const char *key)
+{
+	struct argument **schema = event->args.schema;
+	int i, n;
+
+	if (schema == NULL)
+		return -1;
+
+	for (i = 0, n = 0; schema[i] && (n < ACTION_ARGS_MAX); i++)
+	{
+		if (schema[i]->direction != PARAM_DIR_IN)
+			continue;
+		if (strcmp(schema[i]->name, key) == 0)
+			return n;
+		n++;
+	}
+
+	return -1;
+}
+
+// Argument text, valid for the duration of the request
+const char *upnp_get_string(struct action_event *event, const char *key)
+{
+	int n;
+
+	n = upnp_find_arg(event, key);
+	if (n < 0)
+	{
+		upnp_set_error(event, UPNP_SOAP_E_INVALID_ARGS,
+			       "Missing action request argument (%s)", key);
+		return NULL;
+	}
+
+	return event->args.values[n];
+}
+
+// Integer or boolean argument (parsed when the request arrived)
+int upnp_get_int(struct action_event *event, const char *key, long long *value)
+{
+	int n;
+
+	n = upnp_find_arg(event, key);
+	if (n < 0)
+	{
+		upnp_set_error(event, UPNP_SOAP_E_INVALID_ARGS,
+			       "Missing action request argument (%s)", key);
+		return -1;
+	}
+
+	*value = event->args.numbers[n];
+
+	return 0;
 }
 
 int upnp_obtain_instanceid(struct action_event *event, int *instance)
 {
-	char *value;
-	int instance_id = -1;
+	long long instance_id;
 
-	value = upnp_get_string(event, "InstanceID");
-	if (value == NULL)
+	if (upnp_get_int(event, "InstanceID", &instance_id) != 0)
 	{
 		upnp_set_error(event, UPNP_SOAP_E_INVALID_ARGS, "Missing InstanceID");
 		return -1;
 	}
 
-	DBG_PRINT(DBG_LVL5, "%s: InstanceID='%s'\n", __FUNCTION__, value);
+	DBG_PRINT(DBG_LVL5, "%s: InstanceID=%lld\n", __FUNCTION__, instance_id);
 
-	// Check numeric?
-	instance_id = atoi(value);
 	if (instance)
 		*instance = instance_id;
 
-	free(value);
-
 	// We are only allowing '0' InstanceID for now
 	return (instance_id != 0) ? -1 : 0;
 }
 
+// A cached response stands for every request of the action, so it may
+// not depend on any argument other than the (checked) InstanceID
+DBG_STATIC int response_cache_allowed(struct argument **schema)
+{
+	int i;
+
+	for (i = 0; schema && schema[i]; i++)
+	{
+		if ((schema[i]->direction == PARAM_DIR_IN) &&
+		    (strcmp(schema[i]->name, "InstanceID") != 0))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+// Only requests for instance 0 (or without an instance) share a response
+DBG_STATIC int response_cacheable(struct action_event *event)
+{
+	int n;
+
+	n = upnp_find_arg(event, "InstanceID");
+
+	return (n < 0) || (event->args.numbers[n] == 0);
+}
+
+// Copy of the cached response document if it shows state 'version'
+DBG_STATIC IXML_Document *response_cache_lookup(struct response_cache *cache, unsigned int version)
+{
+	IXML_Document *doc = NULL;
+
+	ithread_mutex_lock(&cache->mutex);
+
+	if ((cache->doc != NULL) && (cache->version == version))
+		doc = (IXML_Document *)ixmlNode_cloneNode((IXML_Node *)cache->doc, TRUE);
+
+	ithread_mutex_unlock(&cache->mutex);
+
+	return doc;
+}
+
+// Keep a copy of 'doc', built at state 'version', as the cached response
+DBG_STATIC void response_cache_store(struct response_cache *cache, unsigned int version, IXML_Document *doc)
+{
+	IXML_Document *copy;
+
+	copy = (IXML_Document *)ixmlNode_cloneNode((IXML_Node *)doc, TRUE);
+	if (copy == NULL)
+		return;
+
+	ithread_mutex_lock(&cache->mutex);
+
+	doc = cache->doc;
+	cache->doc = copy;
+	cache->version = version;
+
+	ithread_mutex_unlock(&cache->mutex);
+
+	if (doc)
+		ixmlDocument_free(doc);
+
+	return;
+}
+
+// (Re)build the initial property set of a service
+// Note: caller must hold service mutex
+DBG_STATIC struct propset *propset_build(struct service *srv, unsigned int version)
+{
+	struct propset *set = srv->initial_set;
+	int i;
+
+	if (set == NULL)
+	{
+		// Evented variables are fixed - size the arrays once
+		set = calloc(1, sizeof(struct propset));
+		if (set == NULL)
+			return NULL;
+
+		for (i = 0; i < srv->variable_count; i++)
+		{
+			if (srv->variable_meta[i].sendevents == SENDEVENT_YES)
+				set->count++;
+		}
+
+		set->names = calloc(set->count + 1, sizeof(const char *));
+		set->values = calloc(set->count + 1, sizeof(char *));
+		if ((set->names == NULL) || (set->values == NULL))
+		{
+			free(set->names);
+			free(set->values);
+			free(set);
+			return NULL;
+		}
+
+		srv->initial_set = set;
+	}
+
+	set->count = 0;
+	for (i = 0; i < srv->variable_count; i++)
+	{
+		if (srv->variable_meta[i].sendevents != SENDEVENT_YES)
+			continue;
+
+		if (set->values[set->count])
+			free(set->values[set->count]);
+
+		set->names[set->count] = srv->variable_names[i];
+		set->values[set->count] = xmlescape(get_service_var(srv, i), 0);
+		DBG_PRINT(DBG_LVL4, "Evented: '%s' = '%s'\n",
+			  set->names[set->count], set->values[set->count]);
+		set->count++;
+	}
+
+	set->version = version;
+
+	DBG_PRINT(DBG_LVL4, "%d evented variables (version %u)\n", set->count, version);
+
+	return set;
+}
+
 DBG_STATIC int handle_subscription_request(struct Upnp_Subscription_Request *sr_event)
 {
 	struct service *srv;
-	int i;
-	int eventVarCount = 0, eventVarIdx = 0;
-	const char **eventvar_names;
-	char **eventvar_values;
+	struct propset *set;
+	unsigned int version;
 	int rc;
 	int result = -1;
 
@@ -240,69 +534,47 @@ DBG_STATIC int handle_subscription_request(struct Upnp_Subscription_Request *sr_
 		goto out;
 	}
 
+	// Serializes use and rebuild of the cached property sets
 	ithread_mutex_lock(&(upnp_device->device_mutex));
 
-	// Does service have a notify routine
-	if (srv->subscription_notify)
-	{
-		// Update LAST_CHANGE before sending it
-		(srv->subscription_notify)();
-	}
+	ithread_mutex_lock(srv->service_mutex);
+	version = srv->state_version;
+	set = srv->initial_set;
+	ithread_mutex_unlock(srv->service_mutex);
 
-	/* generate list of eventable variables */
-	for(i=0; i < srv->variable_count; i++)
+	// Rebuild only if some variable changed since the last one
+	if ((set == NULL) || (set->version != version))
 	{
-		struct var_meta *metaEntry;
-		metaEntry = &(srv->variable_meta[i]);
-		if (metaEntry->sendevents == SENDEVENT_YES)
-			eventVarCount++;
-	}
+		// Does service have a notify routine
+		if (srv->subscription_notify)
+		{
+			// Update LAST_CHANGE before sending it
+			(srv->subscription_notify)();
+		}
 
-	eventvar_names = malloc((eventVarCount + 1) * sizeof(const char *));
-	eventvar_values = malloc((eventVarCount + 1) * sizeof(const char *));
-	DBG_PRINT(DBG_LVL4, "%d evented variables\n", eventVarCount);
+		ithread_mutex_lock(srv->service_mutex);
+		set = propset_build(srv, version);
+		ithread_mutex_unlock(srv->service_mutex);
 
-	for(i=0; i < srv->variable_count; i++)
-	{
-		struct var_meta *metaEntry;
-		metaEntry = &(srv->variable_meta[i]);
-		if (metaEntry->sendevents == SENDEVENT_YES)
+		if (set == NULL)
 		{
-			eventvar_names[eventVarIdx] = srv->variable_names[i];
-			eventvar_values[eventVarIdx] = xmlescape(get_service_var(srv, i), 0);
-			DBG_PRINT(DBG_LVL4, "Evented: '%s' = '%s'\n",
-				  eventvar_names[eventVarIdx],
-				  eventvar_values[eventVarIdx]);
-			eventVarIdx++;
+			fputs("Subscription property set - no memory!\n", stderr);
+			goto unlock;
 		}
 	}
-	eventvar_names[eventVarIdx] = NULL;
-	eventvar_values[eventVarIdx] = NULL;
 
 	rc = UpnpAcceptSubscription(device_handle,
 				    sr_event->UDN, sr_event->ServiceId,
-				    (const char **)eventvar_names,
-				    (const char **)eventvar_values,
-				    eventVarCount,
-				    sr_event->Sid);
+				    set->names, (const char **)set->values,
+				    set->count, sr_event->Sid);
 	if (rc == UPNP_E_SUCCESS)
 	{
 		result = 0;
 	}
 
+unlock:
 	ithread_mutex_unlock(&(upnp_device->device_mutex));
 
-	for(i=0; i < eventVarCount; i++)
-	{
-		// Free temp value storage
-		free(eventvar_values[i]);
-	}
-
-	// Release arrays
-	free(eventvar_names);
-	free(eventvar_values);
-
-
 out:
 	return result;
 }
@@ -327,25 +599,59 @@ DBG_STATIC int handle_action_request(struct Upnp_Action_Request *ar_event)
 	if (event_action->callback)
 	{
 		struct action_event event;
+		struct response_cache *cache;
+		unsigned int version = 0;
 		int rc;
+
 		event.request = ar_event;
 		event.status = 0;
 		event.service = event_service;
 
-		rc = (event_action->callback) (&event);
+		// Arguments are checked once, before the handler runs
+		rc = upnp_extract_args(&event,
+				       event_service->action_arguments[event_action - event_service->actions]);
+
+		// Nothing changed since the last answer - send it again
+		cache = event_action->cache;
+		if ((rc == 0) && (cache != NULL) && response_cacheable(&event))
+		{
+			version = g_atomic_int_get((gint *)&event_service->state_version);
+			ar_event->ActionResult = response_cache_lookup(cache, version);
+			if (ar_event->ActionResult)
+			{
+				DBG_PRINT(DBG_LVL5, "Action: %s answered from cache (version %u)\n",
+					  ar_event->ActionName, version);
+				ar_event->ErrCode = UPNP_E_SUCCESS;
+				return 0;
+			}
+		}
+		else
+			cache = NULL;
+
+		if (rc == 0)
+			rc = (event_action->callback) (&event);
 		if (rc == 0)
 		{
 			ar_event->ErrCode = UPNP_E_SUCCESS;
 			DBG_PRINT(DBG_LVL4, "Action: %s succeeded\n", ar_event->ActionName);
 		}
+		else
+			cache = NULL;
 
 		if (ar_event->ActionResult == NULL)
 		{
+			// Failed actions and actions without output
 			ar_event->ActionResult =
 				UpnpMakeActionResponse(ar_event->ActionName,
-						       ar_event->ServiceID, 0,
+						       event_service->type, 0,
 						       NULL);
 		}
+		else if ((cache != NULL) && (event.status == 0) &&
+			 (g_atomic_int_get((gint *)&event_service->state_version) == version))
+		{
+			// Keep it unless some variable changed while it was built
+			response_cache_store(cache, version, ar_event->ActionResult);
+		}
 	}
 	else
 	{
@@ -393,7 +699,7 @@ int upnp_device_init(struct device *device_def, char *ip_address)
 	struct service *srv;
 	struct icon *icon_entry;
 	char *buf;
-	int i;
+	int i, n;
 
 	if (device_def->init_function)
 	{
@@ -406,6 +712,31 @@ int upnp_device_init(struct device *device_def, char *ip_address)
 
 	upnp_device = device_def;
 
+	/* compile dispatch tables for action and subscription requests */
+	if (upnp_dispatch_init(device_def) != 0)
+		fprintf(stderr, "Dispatch tables unavailable, using linear lookup\n");
+
+	/* response caches for getters (none - always run the handler) */
+	for (i=0; (srv = upnp_device->services[i]); i++)
+	{
+		for (n = 0; srv->actions[n].action_name; n++)
+		{
+			if (!(srv->actions[n].flags & ACTION_CACHED))
+				continue;
+
+			if (!response_cache_allowed(srv->action_arguments[n]))
+			{
+				fprintf(stderr, "%s takes arguments, not cached\n",
+					srv->actions[n].action_name);
+				continue;
+			}
+
+			srv->actions[n].cache = calloc(1, sizeof(struct response_cache));
+			if (srv->actions[n].cache)
+				ithread_mutex_init(&srv->actions[n].cache->mutex, NULL);
+		}
+	}
+
 	/* register icons in web server */
 	for (i=0; (icon_entry = upnp_device->icons[i]); i++)
 	{
@@ -34,9 +34,13 @@ upnp_add_response(struct action_event *event, char *key, const char *value);
 
 extern void upnp_set_error(struct action_event *event, int error_code,
 			   const char *format, ...);
-extern char *upnp_get_string(struct action_event *event, const char *key);
+extern const char *upnp_get_string(struct action_event *event, const char *key);
+extern int upnp_get_int(struct action_event *event, const char *key, long long *value);
 extern int upnp_append_variable(struct action_event *event, int varnum, char *paramname);
+extern int upnp_append_variables(struct action_event *event, const struct response_var *vars);
 extern int upnp_obtain_instanceid(struct action_event *event, int *instance);
+extern int upnp_device_notify(struct service *srv, const char **varnames,
+			      const char **varvalues, int varcount);
 
 extern UpnpDevice_Handle device_handle;
 
@@ -0,0 +1,240 @@
+/* upnp_event.c - Moderated LastChange eventing
+ *
+ * Copyright (C) 2012	     Ted Hess (Kitschensync)
+ *
+ * This file is part of UPnPMPD.
+ *
+ * UPnPMPD is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * UPnPMPD is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with UPnPMPD; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * AVTransport and RenderingControl do not event their state variables
+ * directly. Changes are collected into a single LastChange document which
+ * may be sent at most every 0.2 sec. Each variable carries the version of
+ * its last change; a variable is dirty while its version is newer than the
+ * last event. The first change arms a timer and the timer (on the main loop)
+ * sends one merged <Event> holding only the variables changed in the window.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include <upnp/upnp.h>
+#include <upnp/ithread.h>
+
+#include "logging.h"
+
+#include "xmlescape.h"
+#include "value.h"
+#include "upnp.h"
+#include "upnp_device.h"
+#include "upnp_event.h"
+
+struct lastchange
+{
+	struct service *srv;
+	const char *ns;			// Event namespace
+	int var;				// LastChange variable
+	unsigned int *versions;	// Service state version of last change (per variable)
+	unsigned int flushed;	// Last version included in an event
+	guint timer;			// Moderation timer
+	char *sent;				// Last event sent
+};
+
+struct lastchange *lastchange_new(struct service *srv, const char *ns, int lastchange_var)
+{
+	struct lastchange *lc;
+
+	lc = calloc(1, sizeof(struct lastchange));
+	if (lc == NULL)
+		return NULL;
+
+	lc->versions = calloc(srv->variable_count, sizeof(unsigned int));
+	if (lc->versions == NULL)
+	{
+		free(lc);
+		return NULL;
+	}
+
+	lc->srv = srv;
+	lc->ns = ns;
+	lc->var = lastchange_var;
+
+	return lc;
+}
+
+// Build LastChange document from changed (or all) evented variables
+// Returns NULL if there is nothing to send
+// Note: caller must hold service mutex
+char *lastchange_build(struct lastchange *lc, int all)
+{
+	struct service *srv = lc->srv;
+	GString *buf;
+	const char *value;
+	int count = 0;
+	int i;
+
+	buf = g_string_sized_new(256);
+	g_string_append_printf(buf, "<Event xmlns=\"%s\"><InstanceID val=\"0\">", lc->ns);
+
+	for (i = 0; i < srv->variable_count; i++)
+	{
+		param_event sendevents = srv->variable_meta[i].sendevents;
+
+		if ((sendevents != SENDEVENT_LASTCHANGE) && (sendevents != SENDEVENT_LASTCHANGE_CH))
+			continue;
+		if (!all && (lc->versions[i] <= lc->flushed))
+			continue;
+
+		value = value_get_var(srv, i);
+		if ((value == NULL) && (srv->variable_defaults != NULL))
+			value = srv->variable_defaults[i];
+		if (value == NULL)
+			continue;
+
+		g_string_append_printf(buf, "<%s", srv->variable_names[i]);
+		if (sendevents == SENDEVENT_LASTCHANGE_CH)
+			g_string_append(buf, " Channel=\"Master\"");
+		g_string_append(buf, " val=\"");
+		xmlescape_append(buf, value, 1);
+		g_string_append(buf, "\"/>");
+
+		count++;
+	}
+
+	g_string_append(buf, "</InstanceID></Event>");
+
+	if (count == 0)
+	{
+		g_string_free(buf, TRUE);
+		return NULL;
+	}
+
+	return g_string_free(buf, FALSE);
+}
+
+// Save a built document (or NULL) as the LastChange value, frees 'buf'
+// Note: caller must hold service mutex
+void lastchange_store(struct lastchange *lc, char *buf)
+{
+	char **slot = &lc->srv->variable_values[lc->var];
+
+	if (buf == NULL)
+	{
+		value_unref(*slot);
+		*slot = NULL;
+		return;
+	}
+
+	value_set(slot, buf);
+	free(buf);
+
+	return;
+}
+
+// Moderation window closed - send one event for all changes
+DBG_STATIC gboolean lastchange_expired(gpointer data)
+{
+	struct lastchange *lc = data;
+	struct service *srv = lc->srv;
+	const char *varnames[] =
+	{
+		"LastChange",
+		NULL
+	};
+	char *varvalues[] =
+	{
+		NULL, NULL
+	};
+	char *buf;
+
+	ithread_mutex_lock(srv->service_mutex);
+
+	lc->timer = 0;
+
+	buf = lastchange_build(lc, FALSE);
+
+	lc->flushed = srv->state_version;
+
+	if (buf && lc->sent && (strcmp(lc->sent, buf) == 0))
+	{
+		// Subscribers are up to date
+		free(buf);
+		buf = NULL;
+	}
+
+	if (buf)
+	{
+		if (lc->sent)
+			free(lc->sent);
+		lc->sent = buf;
+
+		// Save as current LastChange value
+		value_set(&srv->variable_values[lc->var], buf);
+
+		DBG_PRINT(DBG_LVL4, "%s Event: '%s'\n", srv->service_name, buf);
+		varvalues[0] = xmlescape(buf, 0);
+	}
+
+	ithread_mutex_unlock(srv->service_mutex);
+
+	if (varvalues[0])
+	{
+		upnp_device_notify(srv, varnames, (const char **)varvalues, 1);
+		free(varvalues[0]);
+	}
+
+	return FALSE;
+}
+
+// Variable changed - bump its version and, if it is evented
+// through LastChange, send it with the next event
+// Note: caller must hold service mutex
+void lastchange_mark(struct lastchange *lc, int varnum)
+{
+	param_event sendevents;
+
+	if (lc == NULL)
+		return;
+
+	// Playback position moves on every poll - it is neither evented nor
+	// read by cached getters, so it must not invalidate them
+	if (lc->srv->variable_meta[varnum].polled)
+		return;
+
+	// Cached getter responses check the version without the lock
+	g_atomic_int_inc((gint *)&lc->srv->state_version);
+	lc->versions[varnum] = lc->srv->state_version;
+
+	sendevents = lc->srv->variable_meta[varnum].sendevents;
+	if ((sendevents != SENDEVENT_LASTCHANGE) && (sendevents != SENDEVENT_LASTCHANGE_CH))
+		return;
+
+	if (lc->timer == 0)
+		lc->timer = g_timeout_add(LASTCHANGE_INTERVAL, lastchange_expired, lc);
+
+	return;
+}
+
@@ -0,0 +1,38 @@
+/* upnp_event.h - Moderated LastChange eventing
+ *
+ * Copyright (C) 2012	     Ted Hess (Kitschensync)
+ *
+ * This file is part of UPnPMPD.
+ *
+ * UPnPMPD is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * UPnPMPD is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with UPnPMPD; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _UPNP_EVENT_H
+#define _UPNP_EVENT_H
+
+// Minimum LastChange interval for AVTransport and RenderingControl (msecs)
+#define LASTCHANGE_INTERVAL	200
+
+struct service;
+struct lastchange;
+
+extern struct lastchange *lastchange_new(struct service *srv, const char *ns, int lastchange_var);
+extern void lastchange_mark(struct lastchange *lc, int varnum);
+extern char *lastchange_build(struct lastchange *lc, int all);
+extern void lastchange_store(struct lastchange *lc, char *buf);
+
+#endif /* _UPNP_EVENT_H */
@@ -40,9 +40,12 @@
 
 #include "logging.h"
 
+#include "metacache.h"
 #include "xmlescape.h"
+#include "value.h"
 #include "upnp.h"
 #include "upnp_device.h"
+#include "upnp_event.h"
 #include "upnp_control.h"
 #include "upnp_transport.h"
 #include "output_mpd.h"
@@ -124,6 +127,7 @@ static const char *transport_defaults[] =
 };
 
 static char *transport_values[sizeof(transport_defaults) / sizeof(char *)];
+static struct var_number transport_numbers[sizeof(transport_defaults) / sizeof(char *)];
 
 static const char *transport_states[] =
 {
@@ -252,36 +256,36 @@ static struct param_range track_nr_range =
 
 static struct var_meta transport_var_meta[] =
 {
-	[TRANSPORT_VAR_TRANSPORT_STATE] =		{ SENDEVENT_NO, DATATYPE_STRING, transport_states, NULL },
-	[TRANSPORT_VAR_TRANSPORT_STATUS] =		{ SENDEVENT_NO, DATATYPE_STRING, transport_stati, NULL },
-	[TRANSPORT_VAR_PLAY_MEDIUM] =			{ SENDEVENT_NO, DATATYPE_STRING, media, NULL },
-	[TRANSPORT_VAR_REC_MEDIUM] =			{ SENDEVENT_NO, DATATYPE_STRING, media, NULL },
-	[TRANSPORT_VAR_PLAY_MEDIA] =			{ SENDEVENT_NO, DATATYPE_STRING, NULL, NULL },
-	[TRANSPORT_VAR_REC_MEDIA] =			    { SENDEVENT_NO, DATATYPE_STRING, NULL, NULL },
-	[TRANSPORT_VAR_CUR_PLAY_MODE] =			{ SENDEVENT_NO, DATATYPE_STRING, playmodi, NULL, "NORMAL" },
-	[TRANSPORT_VAR_TRANSPORT_PLAY_SPEED] =	{ SENDEVENT_NO, DATATYPE_STRING, playspeeds, NULL },
-	[TRANSPORT_VAR_REC_MEDIUM_WR_STATUS] =	{ SENDEVENT_NO, DATATYPE_STRING, rec_write_stati, NULL },
-	[TRANSPORT_VAR_CUR_REC_QUAL_MODE] =		{ SENDEVENT_NO, DATATYPE_STRING, rec_quality_modi, NULL },
-	[TRANSPORT_VAR_POS_REC_QUAL_MODE] =		{ SENDEVENT_NO, DATATYPE_STRING, NULL, NULL },
-	[TRANSPORT_VAR_NR_TRACKS] =			    { SENDEVENT_NO, DATATYPE_UI4, NULL, &track_nr_range }, /* no step */
-	[TRANSPORT_VAR_CUR_TRACK] =			    { SENDEVENT_NO, DATATYPE_UI4, NULL, &track_range },
-	[TRANSPORT_VAR_CUR_TRACK_DUR] =			{ SENDEVENT_NO, DATATYPE_STRING, NULL, NULL },
-	[TRANSPORT_VAR_CUR_MEDIA_DUR] =			{ SENDEVENT_NO, DATATYPE_STRING, NULL, NULL },
-	[TRANSPORT_VAR_CUR_TRACK_META] =		{ SENDEVENT_NO, DATATYPE_STRING, NULL, NULL },
-	[TRANSPORT_VAR_CUR_TRACK_URI] =			{ SENDEVENT_NO, DATATYPE_STRING, NULL, NULL },
-	[TRANSPORT_VAR_AV_URI] =			    { SENDEVENT_NO, DATATYPE_STRING, NULL, NULL },
-	[TRANSPORT_VAR_AV_URI_META] =			{ SENDEVENT_NO, DATATYPE_STRING, NULL, NULL },
-	[TRANSPORT_VAR_NEXT_AV_URI] =			{ SENDEVENT_NO, DATATYPE_STRING, NULL, NULL },
-	[TRANSPORT_VAR_NEXT_AV_URI_META] =		{ SENDEVENT_NO, DATATYPE_STRING, NULL, NULL },
-	[TRANSPORT_VAR_REL_TIME_POS] =			{ SENDEVENT_NO, DATATYPE_STRING, NULL, NULL },
-	[TRANSPORT_VAR_ABS_TIME_POS] =			{ SENDEVENT_NO, DATATYPE_STRING, NULL, NULL },
-	[TRANSPORT_VAR_REL_CTR_POS] =			{ SENDEVENT_NO, DATATYPE_I4, NULL, NULL },
-	[TRANSPORT_VAR_ABS_CTR_POS] =			{ SENDEVENT_NO, DATATYPE_I4, NULL, NULL },
+	[TRANSPORT_VAR_TRANSPORT_STATE] =		{ SENDEVENT_LASTCHANGE, DATATYPE_STRING, transport_states, NULL },
+	[TRANSPORT_VAR_TRANSPORT_STATUS] =		{ SENDEVENT_LASTCHANGE, DATATYPE_STRING, transport_stati, NULL },
+	[TRANSPORT_VAR_PLAY_MEDIUM] =			{ SENDEVENT_LASTCHANGE, DATATYPE_STRING, media, NULL },
+	[TRANSPORT_VAR_REC_MEDIUM] =			{ SENDEVENT_LASTCHANGE, DATATYPE_STRING, media, NULL },
+	[TRANSPORT_VAR_PLAY_MEDIA] =			{ SENDEVENT_LASTCHANGE, DATATYPE_STRING, NULL, NULL },
+	[TRANSPORT_VAR_REC_MEDIA] =			    { SENDEVENT_LASTCHANGE, DATATYPE_STRING, NULL, NULL },
+	[TRANSPORT_VAR_CUR_PLAY_MODE] =			{ SENDEVENT_LASTCHANGE, DATATYPE_STRING, playmodi, NULL, "NORMAL" },
+	[TRANSPORT_VAR_TRANSPORT_PLAY_SPEED] =	{ SENDEVENT_LASTCHANGE, DATATYPE_STRING, playspeeds, NULL },
+	[TRANSPORT_VAR_REC_MEDIUM_WR_STATUS] =	{ SENDEVENT_LASTCHANGE, DATATYPE_STRING, rec_write_stati, NULL },
+	[TRANSPORT_VAR_CUR_REC_QUAL_MODE] =		{ SENDEVENT_LASTCHANGE, DATATYPE_STRING, rec_quality_modi, NULL },
+	[TRANSPORT_VAR_POS_REC_QUAL_MODE] =		{ SENDEVENT_LASTCHANGE, DATATYPE_STRING, NULL, NULL },
+	[TRANSPORT_VAR_NR_TRACKS] =			    { SENDEVENT_LASTCHANGE, DATATYPE_UI4, NULL, &track_nr_range, .format = VARFMT_NUMBER }, /* no step */
+	[TRANSPORT_VAR_CUR_TRACK] =			    { SENDEVENT_LASTCHANGE, DATATYPE_UI4, NULL, &track_range, .format = VARFMT_NUMBER },
+	[TRANSPORT_VAR_CUR_TRACK_DUR] =			{ SENDEVENT_LASTCHANGE, DATATYPE_STRING, NULL, NULL, .format = VARFMT_TIME },
+	[TRANSPORT_VAR_CUR_MEDIA_DUR] =			{ SENDEVENT_LASTCHANGE, DATATYPE_STRING, NULL, NULL, .format = VARFMT_TIME },
+	[TRANSPORT_VAR_CUR_TRACK_META] =		{ SENDEVENT_LASTCHANGE, DATATYPE_STRING, NULL, NULL },
+	[TRANSPORT_VAR_CUR_TRACK_URI] =			{ SENDEVENT_LASTCHANGE, DATATYPE_STRING, NULL, NULL },
+	[TRANSPORT_VAR_AV_URI] =			    { SENDEVENT_LASTCHANGE, DATATYPE_STRING, NULL, NULL },
+	[TRANSPORT_VAR_AV_URI_META] =			{ SENDEVENT_LASTCHANGE, DATATYPE_STRING, NULL, NULL },
+	[TRANSPORT_VAR_NEXT_AV_URI] =			{ SENDEVENT_LASTCHANGE, DATATYPE_STRING, NULL, NULL },
+	[TRANSPORT_VAR_NEXT_AV_URI_META] =		{ SENDEVENT_LASTCHANGE, DATATYPE_STRING, NULL, NULL },
+	[TRANSPORT_VAR_REL_TIME_POS] =			{ SENDEVENT_NO, DATATYPE_STRING, NULL, NULL, .format = VARFMT_TIME, .polled = 1 },
+	[TRANSPORT_VAR_ABS_TIME_POS] =			{ SENDEVENT_NO, DATATYPE_STRING, NULL, NULL, .format = VARFMT_TIME, .polled = 1 },
+	[TRANSPORT_VAR_REL_CTR_POS] =			{ SENDEVENT_NO, DATATYPE_I4, NULL, NULL, .format = VARFMT_NUMBER, .polled = 1 },
+	[TRANSPORT_VAR_ABS_CTR_POS] =			{ SENDEVENT_NO, DATATYPE_I4, NULL, NULL, .format = VARFMT_NUMBER, .polled = 1 },
 	[TRANSPORT_VAR_LAST_CHANGE] =			{ SENDEVENT_YES, DATATYPE_STRING, NULL, NULL },
 	[TRANSPORT_VAR_AAT_SEEK_MODE] =			{ SENDEVENT_NO, DATATYPE_STRING, aat_seekmodi, NULL },
 	[TRANSPORT_VAR_AAT_SEEK_TARGET] =		{ SENDEVENT_NO, DATATYPE_STRING, NULL, NULL },
 	[TRANSPORT_VAR_AAT_INSTANCE_ID] =		{ SENDEVENT_NO, DATATYPE_UI4, NULL, NULL },
-	[TRANSPORT_VAR_CUR_TRANSPORT_ACTIONS] =	{ SENDEVENT_NO, DATATYPE_STRING, NULL, NULL },
+	[TRANSPORT_VAR_CUR_TRANSPORT_ACTIONS] =	{ SENDEVENT_LASTCHANGE, DATATYPE_STRING, NULL, NULL },
 	[TRANSPORT_VAR_UNKNOWN] =			    { SENDEVENT_NO, DATATYPE_UNKNOWN, NULL, NULL }
 };
 
@@ -293,12 +297,13 @@ static struct argument *arguments_setavtransporturi[] =
 	NULL
 };
 
-//static struct argument *arguments_setnextavtransporturi[] = {
-//        & (struct argument) { "InstanceID", PARAM_DIR_IN, TRANSPORT_VAR_AAT_INSTANCE_ID },
-//        & (struct argument) { "NextURI", PARAM_DIR_IN, TRANSPORT_VAR_NEXT_AV_URI },
-//        & (struct argument) { "NextURIMetaData", PARAM_DIR_IN, TRANSPORT_VAR_NEXT_AV_URI_META },
-//        NULL
-//};
+static struct argument *arguments_setnextavtransporturi[] =
+{
+	& (struct argument) { "InstanceID", PARAM_DIR_IN, TRANSPORT_VAR_AAT_INSTANCE_ID },
+	& (struct argument) { "NextURI", PARAM_DIR_IN, TRANSPORT_VAR_NEXT_AV_URI },
+	& (struct argument) { "NextURIMetaData", PARAM_DIR_IN, TRANSPORT_VAR_NEXT_AV_URI_META },
+	NULL
+};
 
 static struct argument *arguments_getmediainfo[] =
 {
@@ -417,7 +422,7 @@ static struct argument **argument_list[] =
 	[TRANSPORT_CMD_SETAVTRANSPORTURI] =         arguments_setavtransporturi,
 	[TRANSPORT_CMD_GETDEVICECAPABILITIES] =     arguments_getdevicecapabilities,
 	[TRANSPORT_CMD_GETMEDIAINFO] =              arguments_getmediainfo,
-	//[TRANSPORT_CMD_SETNEXTAVTRANSPORTURI] =     arguments_setnextavtransporturi,
+	[TRANSPORT_CMD_SETNEXTAVTRANSPORTURI] =     arguments_setnextavtransporturi,
 	[TRANSPORT_CMD_GETTRANSPORTINFO] =          arguments_gettransportinfo,
 	[TRANSPORT_CMD_GETPOSITIONINFO] =           arguments_getpositioninfo,
 	[TRANSPORT_CMD_GETTRANSPORTSETTINGS] =      arguments_gettransportsettings,
@@ -440,6 +445,23 @@ static ithread_mutex_t transport_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static enum _transport_state transport_state = -1;
 
+// Moderated LastChange eventing
+static struct lastchange *transport_lastchange = NULL;
+
+static const struct response_var media_info_vars[] =
+{
+	{ TRANSPORT_VAR_NR_TRACKS, "NrTracks" },
+	{ TRANSPORT_VAR_CUR_MEDIA_DUR, "MediaDuration" },
+	{ TRANSPORT_VAR_AV_URI, "CurrentURI" },
+	{ TRANSPORT_VAR_AV_URI_META, "CurrentURIMetaData" },
+	{ TRANSPORT_VAR_NEXT_AV_URI, "NextURI" },
+	{ TRANSPORT_VAR_NEXT_AV_URI_META, "NextURIMetaData" },
+	{ TRANSPORT_VAR_REC_MEDIA, "PlayMedium" },
+	{ TRANSPORT_VAR_REC_MEDIUM, "RecordMedium" },
+	{ TRANSPORT_VAR_REC_MEDIUM_WR_STATUS, "WriteStatus" },
+	{ 0, NULL }
+};
+
 static int get_media_info(struct action_event *event)
 {
 	int rc = -1;
@@ -450,92 +472,41 @@ static int get_media_info(struct action_event *event)
 		return -1;
 	}
 
-	rc = upnp_append_variable(event, TRANSPORT_VAR_NR_TRACKS, "NrTracks");
-	if (rc)
-		goto out;
-
-	rc = upnp_append_variable(event, TRANSPORT_VAR_CUR_MEDIA_DUR, "MediaDuration");
-	if (rc)
-		goto out;
-
-	rc = upnp_append_variable(event, TRANSPORT_VAR_AV_URI, "CurrentURI");
-	if (rc)
-		goto out;
-
-	rc = upnp_append_variable(event, TRANSPORT_VAR_AV_URI_META, "CurrentURIMetaData");
-	if (rc)
-		goto out;
-
-	rc = upnp_append_variable(event, TRANSPORT_VAR_NEXT_AV_URI, "NextURI");
-	if (rc)
-		goto out;
-
-	rc = upnp_append_variable(event, TRANSPORT_VAR_NEXT_AV_URI_META, "NextURIMetaData");
-	if (rc)
-		goto out;
-
-	rc = upnp_append_variable(event, TRANSPORT_VAR_REC_MEDIA, "PlayMedium");
-	if (rc)
-		goto out;
-
-	rc = upnp_append_variable(event, TRANSPORT_VAR_REC_MEDIUM, "RecordMedium");
-	if (rc)
-		goto out;
+	rc = upnp_append_variables(event, media_info_vars);
 
-	rc = upnp_append_variable(event,
-				  TRANSPORT_VAR_REC_MEDIUM_WR_STATUS,
-				  "WriteStatus");
-	if (rc)
-		goto out;
-
-out:
 	return rc;
 }
 
-DBG_STATIC void transport_notify_lastchange(struct action_event *event, char *value)
+void transport_set_var(int varnum, const char *value)
 {
-	const char *varnames[] =
-	{
-		"LastChange",
-		NULL
-	};
-	char *varvalues[] =
-	{
-		NULL, NULL
-	};
+	assert((varnum >= 0) && (varnum < TRANSPORT_VAR_UNKNOWN));
 
-	DBG_PRINT(DBG_LVL4, "AVT Event: '%s'\n", value);
-	varvalues[0] = xmlescape(value, 0);
+	if (value == NULL)
+		return;
+
+	// String value replaces any typed one
+	transport_numbers[varnum].state = VARNUM_UNSET;
 
-	if (transport_values[TRANSPORT_VAR_LAST_CHANGE])
-		free(transport_values[TRANSPORT_VAR_LAST_CHANGE]);
+	// Any change - return if identical
+	if (!value_set(&transport_values[varnum], value))
+		return;
 
-	// Save arg
-	transport_values[TRANSPORT_VAR_LAST_CHANGE] = value;
-	UpnpNotify(device_handle, event->request->DevUDN,
-		   event->request->ServiceID,
-		   varnames, (const char **)varvalues, 1);
+	// Version change (evented with next LastChange)
+	lastchange_mark(transport_lastchange, varnum);
 
-	free(varvalues[0]);
+	return;
 }
 
-void transport_set_var(int varnum, char *value)
+// Typed (numeric or time) variable, formatted when read
+void transport_set_number(int varnum, long long number)
 {
 	assert((varnum >= 0) && (varnum < TRANSPORT_VAR_UNKNOWN));
 
-	if (value == NULL)
+	if (!value_set_number(&transport_service, varnum, number))
 		return;
 
-	if (transport_values[varnum])
-	{
-		// Any change - return if identical
-		if (strcmp(transport_values[varnum], value) == 0)
-			return;
-		// Free old value before saving new one
-		free(transport_values[varnum]);
-	}
-
-	transport_values[varnum] = strdup(value);
+	// Version change (evented with next LastChange)
+	lastchange_mark(transport_lastchange, varnum);
 
 	return;
 }
@@ -544,7 +515,7 @@ char *transport_get_var(int varnum)
 {
 	assert((varnum >= 0) && (varnum < TRANSPORT_VAR_UNKNOWN));
 
-	return transport_values[varnum];
+	return value_get_var(&transport_service, varnum);
 }
 
 void transport_set_state(enum _transport_state state, char *value)
@@ -555,97 +526,57 @@ void transport_set_state(enum _transport_state state, char *value)
 	return;
 }
 
-/* warning - does not lock service mutex */
-DBG_STATIC void transport_change_var(struct action_event *event, int varnum, char *new_value)
+// Refresh from MPD and event any changes (MPD idle monitor)
+void transport_notify_status(void)
 {
-	char *buf;
-
-	transport_set_var(varnum, new_value);
+	ithread_mutex_lock(&transport_mutex);
 
-	asprintf(&buf,
-		 "<Event xmlns=\"urn:schemas-upnp-org:metadata-1-0/AVT/\">"
-		 "<InstanceID val=\"0\"><%s val=\"%s\"/></InstanceID></Event>",
-		 transport_variables[varnum], transport_values[varnum]);
+	// Changed variables are evented with the next LastChange
+	output_update_status();
 
-	transport_notify_lastchange(event, buf);
+	ithread_mutex_unlock(&transport_mutex);
 
 	return;
 }
 
-DBG_STATIC char *transport_get_state_lastchange(void)
+// MPD started playing the next URI - make it current
+// Note: caller must hold transport_mutex
+void transport_promote_next(void)
 {
-	char *buf;
-
-	// Construct LastChange event accordingly
-	if (strcmp(transport_values[TRANSPORT_VAR_CUR_TRACK_URI], "") == 0)
-	{
-		asprintf(&buf,
-			 "<Event xmlns=\"urn:schemas-upnp-org:metadata-1-0/AVT/\">"
-			 "<InstanceID val=\"0\">"
-			 "<%s val=\"%s\"/><%s val=\"%s\"/>"
-			 "</InstanceID></Event>",
-			 transport_variables[TRANSPORT_VAR_TRANSPORT_STATE], transport_values[TRANSPORT_VAR_TRANSPORT_STATE],
-			 transport_variables[TRANSPORT_VAR_TRANSPORT_STATUS], transport_values[TRANSPORT_VAR_TRANSPORT_STATUS]);
-	}
-	else
-	{
-		asprintf(&buf,
-			 "<Event xmlns=\"urn:schemas-upnp-org:metadata-1-0/AVT/\">"
-			 "<InstanceID val=\"0\">"
-			 "<%s val=\"%s\"/><%s val=\"%s\"/><%s val=\"%s\"/><%s val=\"%s\"/><%s val=\"%s\"/>"
-			 "</InstanceID></Event>",
-			 transport_variables[TRANSPORT_VAR_TRANSPORT_STATE], transport_values[TRANSPORT_VAR_TRANSPORT_STATE],
-			 transport_variables[TRANSPORT_VAR_TRANSPORT_STATUS], transport_values[TRANSPORT_VAR_TRANSPORT_STATUS],
-			 transport_variables[TRANSPORT_VAR_CUR_TRACK_URI], transport_values[TRANSPORT_VAR_CUR_TRACK_URI],
-			 transport_variables[TRANSPORT_VAR_CUR_TRACK_META], transport_values[TRANSPORT_VAR_CUR_TRACK_META],
-			 transport_variables[TRANSPORT_VAR_CUR_TRACK_DUR], transport_values[TRANSPORT_VAR_CUR_TRACK_DUR]);
-	}
-
+	const struct meta_entry *entry;
+	char *value;
 
-	return buf;
-}
+	value = transport_values[TRANSPORT_VAR_NEXT_AV_URI];
+	if (!value || (strcmp(value, "") == 0))
+		return;
 
-// Extract attribute from URI_METADATA
-const char *transport_get_attr_metadata(const char *key)
-{
-	IXML_Document *doc;
-	IXML_Element *elm;
-	const char *attr = NULL;
+	entry = metacache_lookup(value, transport_values[TRANSPORT_VAR_NEXT_AV_URI_META]);
 
-	const char *metadata = transport_get_var(TRANSPORT_VAR_AV_URI_META);
+	transport_set_var(TRANSPORT_VAR_AV_URI, value);
+	transport_set_var(TRANSPORT_VAR_CUR_TRACK_URI, value);
 
-	if (!metadata || (strcmp(metadata, "") == 0))
-		return NULL;
+	value = transport_values[TRANSPORT_VAR_NEXT_AV_URI_META];
+	transport_set_var(TRANSPORT_VAR_AV_URI_META, value);
+	transport_set_var(TRANSPORT_VAR_CUR_TRACK_META, value);
 
-	doc = ixmlParseBuffer(metadata);
-	if (doc)
-	{
-		// Locate 'res' element
-		elm = ixmlDocument_getElementById(doc, "res");
-		if (elm != NULL)
-		{
-			// Look for 'key' attribute in 'res' element
-			attr = ixmlElement_getAttribute(elm, key);
-			// Copy of result (caller must free)
-			if (attr)
-				attr = strdup(attr);
-		}
+	// Duration from the new metadata (MPD may know better later)
+	if (entry && entry->duration)
+		transport_set_var(TRANSPORT_VAR_CUR_TRACK_DUR, (char *)entry->duration);
 
-		// Free the whole DOM
-		ixmlDocument_free(doc);
-	}
+	transport_set_var(TRANSPORT_VAR_NEXT_AV_URI, "");
+	transport_set_var(TRANSPORT_VAR_NEXT_AV_URI_META, "");
 
-	DBG_PRINT(DBG_LVL1, "Track metadata: %s = %s\n", key, (attr) ? attr : "<not found>");
+	DBG_PRINT(DBG_LVL1, "Next URI is now current: %s\n", transport_values[TRANSPORT_VAR_AV_URI]);
 
-	// NULL if not found
-	return attr;
+	return;
 }
 
 /* UPnP action handlers */
 
 DBG_STATIC int set_avtransport_uri(struct action_event *event)
 {
-	char *value;
+	const struct meta_entry *entry;
+	const char *value, *metadata;
 	int rc = 0;
 
 	if (upnp_obtain_instanceid(event, NULL))
@@ -658,6 +589,8 @@ DBG_STATIC int set_avtransport_uri(struct action_event *event)
 	if (value == NULL)
 		return -1;
 
+	metadata = upnp_get_string(event, "CurrentURIMetaData");
+
 	ithread_mutex_lock(&transport_mutex);
 
 	DBG_PRINT(DBG_LVL4, "%s: Set URI to '%s'\n", __FUNCTION__, value);
@@ -667,24 +600,26 @@ DBG_STATIC int set_avtransport_uri(struct action_event *event)
 
 	transport_set_var(TRANSPORT_VAR_AV_URI, value);
 
-	free(value);
+	// Queue was cleared - no next track any more
+	transport_set_var(TRANSPORT_VAR_NEXT_AV_URI, "");
+	transport_set_var(TRANSPORT_VAR_NEXT_AV_URI_META, "");
 
-	value = upnp_get_string(event, "CurrentURIMetaData");
-	if (value != NULL)
+	if (metadata != NULL)
 	{
-		DBG_PRINT(DBG_LVL4, "%s: Set URI MetaData to '%s'\n", __FUNCTION__, value);
+		DBG_PRINT(DBG_LVL4, "%s: Set URI MetaData to '%s'\n", __FUNCTION__, metadata);
 
-		// First set new value so we may extract some information about
-		// the stream (Ex: track_duration)
-		transport_set_var(TRANSPORT_VAR_AV_URI_META, value);
-		free(value);
+		transport_set_var(TRANSPORT_VAR_AV_URI_META, metadata);
 
-		// Locate duration attribute in 'res' element under 'item'
-		value = (char *)transport_get_attr_metadata("duration");
-		if (value)
+		// Parsed before if the controller repeats itself
+		entry = metacache_lookup(value, metadata);
+		if (entry)
 		{
-			transport_set_var(TRANSPORT_VAR_CUR_TRACK_DUR, value);
-			free(value);
+			transport_set_var(TRANSPORT_VAR_CUR_TRACK_URI, value);
+			transport_set_var(TRANSPORT_VAR_CUR_TRACK_META, (char *)entry->track_meta);
+
+			// Duration attribute of 'res' element under 'item'
+			if (entry->duration)
+				transport_set_var(TRANSPORT_VAR_CUR_TRACK_DUR, (char *)entry->duration);
 		}
 	}
 	else
@@ -695,38 +630,68 @@ DBG_STATIC int set_avtransport_uri(struct action_event *event)
 	transport_state = TRANSPORT_STOPPED;
 	transport_set_var(TRANSPORT_VAR_TRANSPORT_STATE, "STOPPED");
 
-	transport_notify_lastchange(event, transport_get_state_lastchange());
-
 	ithread_mutex_unlock(&transport_mutex);
 
 	return rc;
 }
 
-//DBG_STATIC int set_next_avtransport_uri(struct action_event *event)
-//{
-//	char *value;
-//
-//	if (upnp_obtain_instanceid(event, NULL))
-//	{
-//	    upnp_set_error(event, UPNP_TRANSPORT_E_INVALID_IID, "ID non-zero invalid");
-//		return -1;
-//	}
-//
-//	value = upnp_get_string(event, "NextURI");
-//	if (value == NULL) {
-//		return -1;
-//	}
-//	DBG_PRINT(DBG_LVL4, "%s: NextURI='%s'\n", __FUNCTION__, value);
-//	free(value);
-//	value = upnp_get_string(event, "NextURIMetaData");
-//	if (value == NULL) {
-//		return -1;
-//	}
-//	DBG_PRINT(DBG_LVL4, "%s: NextURIMetaData='%s'\n", __FUNCTION__, value);
-//	free(value);
-//
-//	return 0;
-//}
+DBG_STATIC int set_next_avtransport_uri(struct action_event *event)
+{
+	const char *value;
+	int rc;
+
+	if (upnp_obtain_instanceid(event, NULL))
+	{
+		upnp_set_error(event, UPNP_TRANSPORT_E_INVALID_IID, "ID non-zero invalid");
+		return -1;
+	}
+
+	value = upnp_get_string(event, "NextURI");
+	if (value == NULL)
+		return -1;
+
+	// Check MPD connection
+	if (check_mpd_connection() == STATUS_FAIL)
+		return -1;
+
+	ithread_mutex_lock(&transport_mutex);
+
+	DBG_PRINT(DBG_LVL4, "%s: NextURI='%s'\n", __FUNCTION__, value);
+
+	// Queue behind the current track
+	rc = output_set_next_uri(value);
+	if (rc != 0)
+	{
+		ithread_mutex_unlock(&transport_mutex);
+		upnp_set_error(event, UPNP_TRANSPORT_E_RES_NOT_FOUND, "Next URI not accepted");
+		return -1;
+	}
+
+	transport_set_var(TRANSPORT_VAR_NEXT_AV_URI, value);
+
+	value = upnp_get_string(event, "NextURIMetaData");
+	if (value != NULL)
+	{
+		DBG_PRINT(DBG_LVL4, "%s: NextURIMetaData='%s'\n", __FUNCTION__, value);
+		transport_set_var(TRANSPORT_VAR_NEXT_AV_URI_META, value);
+	}
+	else
+	{
+		transport_set_var(TRANSPORT_VAR_NEXT_AV_URI_META, "");
+	}
+
+	ithread_mutex_unlock(&transport_mutex);
+
+	return 0;
+}
+
+static const struct response_var transport_info_vars[] =
+{
+	{ TRANSPORT_VAR_TRANSPORT_STATE, "CurrentTransportState" },
+	{ TRANSPORT_VAR_TRANSPORT_STATUS, "CurrentTransportStatus" },
+	{ TRANSPORT_VAR_TRANSPORT_PLAY_SPEED, "CurrentSpeed" },
+	{ 0, NULL }
+};
 
 DBG_STATIC int get_transport_info(struct action_event *event)
 {
@@ -738,22 +703,18 @@ DBG_STATIC int get_transport_info(struct action_event *event)
 		//return -1;
 	}
 
-	rc = upnp_append_variable(event, TRANSPORT_VAR_TRANSPORT_STATE, "CurrentTransportState");
-	if (rc)
-		goto out;
-
-	rc = upnp_append_variable(event, TRANSPORT_VAR_TRANSPORT_STATUS, "CurrentTransportStatus");
-	if (rc)
-		goto out;
-
-	rc = upnp_append_variable(event, TRANSPORT_VAR_TRANSPORT_PLAY_SPEED, "CurrentSpeed");
-	if (rc)
-		goto out;
+	rc = upnp_append_variables(event, transport_info_vars);
 
-out:
 	return rc;
 }
 
+static const struct response_var transport_settings_vars[] =
+{
+	{ TRANSPORT_VAR_CUR_PLAY_MODE, "CurrentPlayMode" },
+	{ TRANSPORT_VAR_CUR_REC_QUAL_MODE, "CurrentRecordQualityMode" },
+	{ 0, NULL }
+};
+
 DBG_STATIC int get_transport_settings(struct action_event *event)
 {
 	int rc = -1;
@@ -764,18 +725,24 @@ DBG_STATIC int get_transport_settings(struct action_event *event)
 		return -1;
 	}
 
-	rc = upnp_append_variable(event, TRANSPORT_VAR_CUR_PLAY_MODE, "CurrentPlayMode");
-	if (rc)
-		goto out;
+	rc = upnp_append_variables(event, transport_settings_vars);
 
-	rc = upnp_append_variable(event, TRANSPORT_VAR_CUR_REC_QUAL_MODE, "CurrentRecordQualityMode");
-	if (rc)
-		goto out;
-
-out:
 	return rc;
 }
 
+static const struct response_var position_info_vars[] =
+{
+	{ TRANSPORT_VAR_CUR_TRACK, "Track" },
+	{ TRANSPORT_VAR_CUR_TRACK_DUR, "TrackDuration" },
+	{ TRANSPORT_VAR_CUR_TRACK_META, "TrackMetaData" },
+	{ TRANSPORT_VAR_CUR_TRACK_URI, "TrackURI" },
+	{ TRANSPORT_VAR_REL_TIME_POS, "RelTime" },
+	{ TRANSPORT_VAR_ABS_TIME_POS, "AbsTime" },
+	{ TRANSPORT_VAR_REL_CTR_POS, "RelCount" },
+	{ TRANSPORT_VAR_ABS_CTR_POS, "AbsCount" },
+	{ 0, NULL }
+};
+
 DBG_STATIC int get_position_info(struct action_event *event)
 {
 	int rc = -1;
@@ -793,39 +760,8 @@ DBG_STATIC int get_position_info(struct action_event *event)
 
 	ithread_mutex_unlock(&transport_mutex);
 
-	rc = upnp_append_variable(event, TRANSPORT_VAR_CUR_TRACK, "Track");
-	if (rc)
-		goto out;
+	rc = upnp_append_variables(event, position_info_vars);
 
-	rc = upnp_append_variable(event, TRANSPORT_VAR_CUR_TRACK_DUR, "TrackDuration");
-	if (rc)
-		goto out;
-
-	rc = upnp_append_variable(event, TRANSPORT_VAR_CUR_TRACK_META, "TrackMetaData");
-	if (rc)
-		goto out;
-
-	rc = upnp_append_variable(event, TRANSPORT_VAR_CUR_TRACK_URI, "TrackURI");
-	if (rc)
-		goto out;
-
-	rc = upnp_append_variable(event, TRANSPORT_VAR_REL_TIME_POS, "RelTime");
-	if (rc)
-		goto out;
-
-	rc = upnp_append_variable(event, TRANSPORT_VAR_ABS_TIME_POS, "AbsTime");
-	if (rc)
-		goto out;
-
-	rc = upnp_append_variable(event, TRANSPORT_VAR_REL_CTR_POS, "RelCount");
-	if (rc)
-		goto out;
-
-	rc = upnp_append_variable(event, TRANSPORT_VAR_ABS_CTR_POS, "AbsCount");
-	if (rc)
-		goto out;
-
-out:
 	return rc;
 }
 
@@ -846,7 +782,7 @@ DBG_STATIC int get_device_caps(struct action_event *event)
 
 DBG_STATIC int xplaymode(struct action_event *event)
 {
-	char *newmode;
+	const char *newmode;
 	int rc = 0;
 
 	if (upnp_obtain_instanceid(event, NULL))
@@ -856,10 +792,13 @@ DBG_STATIC int xplaymode(struct action_event *event)
 	}
 
 	newmode = upnp_get_string(event, "NewPlayMode");
+	if (newmode == NULL)
+		return -1;
+
 	DBG_PRINT(DBG_LVL4, "Set NewPlayMode: %s\n", newmode);
 
 	// Check MPD connection
-	if (check_mpd_connection(TRUE) == STATUS_FAIL)
+	if (check_mpd_connection() == STATUS_FAIL)
 		return -1;
 
 	ithread_mutex_lock(&transport_mutex);
@@ -867,13 +806,11 @@ DBG_STATIC int xplaymode(struct action_event *event)
 	rc = output_playmode(newmode);
 	if (rc != 0)
 	{
-		free(newmode);
 		upnp_set_error(event, UPNP_TRANSPORT_E_PLAYMODE_NS, "Set playmode failed");
 		goto out;
 	}
 
-	transport_change_var(event, TRANSPORT_VAR_CUR_PLAY_MODE, newmode);
-	free(newmode);
+	transport_set_var(TRANSPORT_VAR_CUR_PLAY_MODE, newmode);
 
 out:
 	ithread_mutex_unlock(&transport_mutex);
@@ -892,7 +829,7 @@ DBG_STATIC int xstop(struct action_event *event)
 	}
 
 	// Check MPD connection
-	if (check_mpd_connection(TRUE) == STATUS_FAIL)
+	if (check_mpd_connection() == STATUS_FAIL)
 		return -1;
 
 	ithread_mutex_lock(&transport_mutex);
@@ -912,7 +849,7 @@ DBG_STATIC int xstop(struct action_event *event)
 		else
 		{
 			transport_state = TRANSPORT_STOPPED;
-			transport_change_var(event, TRANSPORT_VAR_TRANSPORT_STATE, "STOPPED");
+			transport_set_var(TRANSPORT_VAR_TRANSPORT_STATE, "STOPPED");
 		}
 		// Set TransportPlaySpeed to '1'
 		break;
@@ -940,7 +877,7 @@ DBG_STATIC int xpause(struct action_event *event)
 	}
 
 	// Check MPD connection
-	if (check_mpd_connection(TRUE) == STATUS_FAIL)
+	if (check_mpd_connection() == STATUS_FAIL)
 		return -1;
 
 	ithread_mutex_lock(&transport_mutex);
@@ -958,7 +895,7 @@ DBG_STATIC int xpause(struct action_event *event)
 		else
 		{
 			transport_state = TRANSPORT_PAUSED_PLAYBACK;
-			transport_change_var(event, TRANSPORT_VAR_TRANSPORT_STATE, "PAUSED_PLAYBACK");
+			transport_set_var(TRANSPORT_VAR_TRANSPORT_STATE, "PAUSED_PLAYBACK");
 		}
 		break;
 
@@ -971,7 +908,7 @@ DBG_STATIC int xpause(struct action_event *event)
 		else
 		{
 			transport_state = TRANSPORT_PLAYING;
-			transport_change_var(event, TRANSPORT_VAR_TRANSPORT_STATE, "PLAYING");
+			transport_set_var(TRANSPORT_VAR_TRANSPORT_STATE, "PLAYING");
 		}
 		break;
 
@@ -998,7 +935,7 @@ DBG_STATIC int xplay(struct action_event *event)
 	}
 
 	// Check MPD connection
-	if (check_mpd_connection(TRUE) == STATUS_FAIL)
+	if (check_mpd_connection() == STATUS_FAIL)
 		return -1;
 
 	ithread_mutex_lock(&transport_mutex);
@@ -1019,7 +956,7 @@ DBG_STATIC int xplay(struct action_event *event)
 		else
 		{
 			transport_state = TRANSPORT_PLAYING;
-			transport_change_var(event, TRANSPORT_VAR_TRANSPORT_STATE, "PLAYING");
+			transport_set_var(TRANSPORT_VAR_TRANSPORT_STATE, "PLAYING");
 
 		}
 		// Set TransportPlaySpeed to '1'
@@ -1042,7 +979,7 @@ DBG_STATIC int xplay(struct action_event *event)
 
 DBG_STATIC int xseek(struct action_event *event)
 {
-	char *value, *mode;
+	const char *value, *mode;
 	int rc = 0;
 
 	if (upnp_obtain_instanceid(event, NULL))
@@ -1058,19 +995,26 @@ DBG_STATIC int xseek(struct action_event *event)
 
 	value = upnp_get_string(event, "Target");
 	if (value == NULL)
+		return -1;
+
+	if ((strcmp(mode, "REL_TIME") != 0) && (strcmp(mode, "ABS_TIME") != 0) &&
+			(strcmp(mode, "TRACK_NR") != 0))
 	{
-		free(mode);
+		upnp_set_error(event, UPNP_TRANSPORT_E_SEEKMODE_NS, "Seek mode not supported");
 		return -1;
 	}
 
 	// Check MPD connection
-	if (check_mpd_connection(TRUE) == STATUS_FAIL)
+	if (check_mpd_connection() == STATUS_FAIL)
 		return -1;
 
+	ithread_mutex_lock(&transport_mutex);
+
 	// Attempt to seek player (doesn't work for streams)
 	rc = output_seekto(mode, value);
-	free(mode);
-	free(value);
+
+	ithread_mutex_unlock(&transport_mutex);
+
 	if (rc != 0)
 	{
 		upnp_set_error(event, UPNP_TRANSPORT_E_ILL_SEEKTARGET, "Player Seek failed");
@@ -1082,6 +1026,8 @@ DBG_STATIC int xseek(struct action_event *event)
 
 DBG_STATIC int xnext(struct action_event *event)
 {
+	int rc;
+
 	if (upnp_obtain_instanceid(event, NULL))
 	{
 		upnp_set_error(event, UPNP_TRANSPORT_E_INVALID_IID, "ID non-zero invalid");
@@ -1089,10 +1035,16 @@ DBG_STATIC int xnext(struct action_event *event)
 	}
 
 	// Check MPD connection
-	if (check_mpd_connection(TRUE) == STATUS_FAIL)
+	if (check_mpd_connection() == STATUS_FAIL)
 		return -1;
 
-	if (output_next())
+	ithread_mutex_lock(&transport_mutex);
+
+	rc = output_next();
+
+	ithread_mutex_unlock(&transport_mutex);
+
+	if (rc)
 	{
 		upnp_set_error(event, UPNP_TRANSPORT_E_TRANSITION_NA, "Player Next failed");
 		return -1;
@@ -1103,6 +1055,8 @@ DBG_STATIC int xnext(struct action_event *event)
 
 DBG_STATIC int xprevious(struct action_event *event)
 {
+	int rc;
+
 	if (upnp_obtain_instanceid(event, NULL))
 	{
 		upnp_set_error(event, UPNP_TRANSPORT_E_INVALID_IID, "ID non-zero invalid");
@@ -1110,10 +1064,16 @@ DBG_STATIC int xprevious(struct action_event *event)
 	}
 
 	// Check MPD connection
-	if (check_mpd_connection(TRUE) == STATUS_FAIL)
+	if (check_mpd_connection() == STATUS_FAIL)
 		return -1;
 
-	if (output_prev())
+	ithread_mutex_lock(&transport_mutex);
+
+	rc = output_prev();
+
+	ithread_mutex_unlock(&transport_mutex);
+
+	if (rc)
 	{
 		upnp_set_error(event, UPNP_TRANSPORT_E_TRANSITION_NA, "Player Previous failed");
 		return -1;
@@ -1126,9 +1086,9 @@ DBG_STATIC int transport_notify_subscription(void)
 {
 	ithread_mutex_lock(&transport_mutex);
 
-	output_update_status();
-
-	transport_set_var(TRANSPORT_VAR_LAST_CHANGE, transport_get_state_lastchange());
+	// State is kept current by the MPD idle monitor - no round trip here
+	// Initial event carries the full state
+	lastchange_store(transport_lastchange, lastchange_build(transport_lastchange, TRUE));
 
 	ithread_mutex_unlock(&transport_mutex);
 
@@ -1138,13 +1098,13 @@ DBG_STATIC int transport_notify_subscription(void)
 static struct action transport_actions[] =
 {
 	[TRANSPORT_CMD_GETCURRENTTRANSPORTACTIONS] = {"GetCurrentTransportActions", NULL},	/* optional */
-	[TRANSPORT_CMD_GETDEVICECAPABILITIES] =     {"GetDeviceCapabilities", get_device_caps},
-	[TRANSPORT_CMD_GETMEDIAINFO] =              {"GetMediaInfo", get_media_info},
+	[TRANSPORT_CMD_GETDEVICECAPABILITIES] =     {"GetDeviceCapabilities", get_device_caps, ACTION_CACHED},
+	[TRANSPORT_CMD_GETMEDIAINFO] =              {"GetMediaInfo", get_media_info, ACTION_CACHED},
 	[TRANSPORT_CMD_SETAVTRANSPORTURI] =         {"SetAVTransportURI", set_avtransport_uri},	/* RC9800i */
-	//[TRANSPORT_CMD_SETNEXTAVTRANSPORTURI] =   {"SetNextAVTransportURI", set_next_avtransport_uri},
+	[TRANSPORT_CMD_SETNEXTAVTRANSPORTURI] =     {"SetNextAVTransportURI", set_next_avtransport_uri},
 	[TRANSPORT_CMD_GETTRANSPORTINFO] =          {"GetTransportInfo", get_transport_info},
 	[TRANSPORT_CMD_GETPOSITIONINFO] =           {"GetPositionInfo", get_position_info},
-	[TRANSPORT_CMD_GETTRANSPORTSETTINGS] =      {"GetTransportSettings", get_transport_settings},
+	[TRANSPORT_CMD_GETTRANSPORTSETTINGS] =      {"GetTransportSettings", get_transport_settings, ACTION_CACHED},
 	[TRANSPORT_CMD_STOP] =                      {"Stop", xstop},
 	[TRANSPORT_CMD_PLAY] =                      {"Play", xplay},
 	[TRANSPORT_CMD_PAUSE] =                     {"Pause", xpause},
@@ -1169,6 +1129,7 @@ struct service transport_service =
 	.action_arguments =     argument_list,
 	.variable_names =       transport_variables,
 	.variable_values =      transport_values,
+	.variable_numbers =     transport_numbers,
 	.variable_defaults =    transport_defaults,
 	.variable_meta =        transport_var_meta,
 	.variable_count =       TRANSPORT_VAR_UNKNOWN,
@@ -1181,13 +1142,19 @@ void transport_init(void)
 {
 	// init values array
 	memset(transport_values, 0, sizeof(transport_values));
+	memset(transport_numbers, 0, sizeof(transport_numbers));
 
 	// Some things that we will need early
-	transport_values[TRANSPORT_VAR_TRANSPORT_STATE] = strdup(transport_defaults[TRANSPORT_VAR_TRANSPORT_STATE]);
-	transport_values[TRANSPORT_VAR_TRANSPORT_STATUS] = strdup(transport_defaults[TRANSPORT_VAR_TRANSPORT_STATUS]);
-	transport_values[TRANSPORT_VAR_CUR_TRACK_URI] = strdup(transport_defaults[TRANSPORT_VAR_CUR_TRACK_URI]);
-	transport_values[TRANSPORT_VAR_CUR_TRACK_META] = strdup(transport_defaults[TRANSPORT_VAR_CUR_TRACK_META]);
-	transport_values[TRANSPORT_VAR_CUR_TRACK_DUR] = strdup(transport_defaults[TRANSPORT_VAR_CUR_TRACK_DUR]);
+	transport_values[TRANSPORT_VAR_TRANSPORT_STATE] = value_new(transport_defaults[TRANSPORT_VAR_TRANSPORT_STATE]);
+	transport_values[TRANSPORT_VAR_TRANSPORT_STATUS] = value_new(transport_defaults[TRANSPORT_VAR_TRANSPORT_STATUS]);
+	transport_values[TRANSPORT_VAR_CUR_TRACK_URI] = value_new(transport_defaults[TRANSPORT_VAR_CUR_TRACK_URI]);
+	transport_values[TRANSPORT_VAR_CUR_TRACK_META] = value_new(transport_defaults[TRANSPORT_VAR_CUR_TRACK_META]);
+	transport_values[TRANSPORT_VAR_CUR_TRACK_DUR] = value_new(transport_defaults[TRANSPORT_VAR_CUR_TRACK_DUR]);
+	transport_values[TRANSPORT_VAR_CUR_PLAY_MODE] = value_new(transport_defaults[TRANSPORT_VAR_CUR_PLAY_MODE]);
+
+	transport_lastchange = lastchange_new(&transport_service,
+					      "urn:schemas-upnp-org:metadata-1-0/AVT/",
+					      TRANSPORT_VAR_LAST_CHANGE);
 
 	return;
 }
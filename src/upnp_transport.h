@@ -97,7 +97,7 @@ typedef enum
 	TRANSPORT_CMD_SETAVTRANSPORTURI,
 	TRANSPORT_CMD_SETPLAYMODE,
 	TRANSPORT_CMD_STOP,
-	//TRANSPORT_CMD_SETNEXTAVTRANSPORTURI,
+	TRANSPORT_CMD_SETNEXTAVTRANSPORTURI,
 	//TRANSPORT_CMD_RECORD,
 	//TRANSPORT_CMD_SETRECORDQUALITYMODE,
 	TRANSPORT_CMD_UNKNOWN,
@@ -118,9 +118,11 @@ enum _transport_state
 extern struct service transport_service;
 
 extern void transport_init(void);
-extern void transport_set_var(int varnum, char *value);
+extern void transport_set_var(int varnum, const char *value);
+extern void transport_set_number(int varnum, long long number);
 extern void transport_set_state(enum _transport_state state, char *value);
 extern char *transport_get_var(int varnum);
-extern const char *transport_get_attr_metadata(const char *key);
+extern void transport_notify_status(void);
+extern void transport_promote_next(void);
 
 #endif /* _UPNP_TRANSPORT_H */
@@ -0,0 +1,296 @@
+/* value.c - Shared state variable values
+ *
+ * Copyright (C) 2012	     Ted Hess (Kitschensync)
+ *
+ * This file is part of UPnPMPD.
+ *
+ * UPnPMPD is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * UPnPMPD is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with UPnPMPD; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+
+/*
+ * State variable values are immutable once stored. Each one is a single
+ * allocation holding a reference count, the length and a hash in front of
+ * the string; the pointer handed out is the string itself so values still
+ * read (and print) as plain C strings.
+ *
+ * Long values (metadata, LastChange, protocol info) are interned: storing
+ * the same text in AV_URI_META and CUR_TRACK_META takes one more reference
+ * rather than another copy. Readers that need a value after dropping the
+ * service mutex take their own reference.
+ *
+ * Numeric variables (positions, counters, durations, volume) are kept
+ * as numbers and formatted only when a response or event reads them, so
+ * a status poll that moves the play position costs no allocation.
+ *
+ * Note: only pointers returned by value_new()/value_ref() may be passed
+ * to value_ref()/value_unref() - never defaults or caller strings.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#include <glib.h>
+
+#include <upnp/ithread.h>
+
+#include "logging.h"
+#include "upnp.h"
+#include "value.h"
+
+#define VALUE_BUCKETS	64
+
+struct value
+{
+	struct value *chain;	// Hash bucket chain (interned values only)
+	gint refs;
+	unsigned int hash;
+	size_t len;
+	char str[];
+};
+
+// Interned values, protects their reference counts reaching zero
+static ithread_mutex_t value_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct value *value_buckets[VALUE_BUCKETS];
+
+#define VALUE_OF(s)	((struct value *)((s) - offsetof(struct value, str)))
+
+// Length and hash in one pass
+DBG_STATIC unsigned int value_hash(const char *str, size_t *len)
+{
+	const unsigned char *p;
+	unsigned int hash = 2166136261u;
+
+	for (p = (const unsigned char *)str; *p; p++)
+		hash = (hash ^ *p) * 16777619u;
+
+	*len = (const char *)p - str;
+
+	return hash;
+}
+
+DBG_STATIC struct value *value_alloc(const char *str, size_t len, unsigned int hash)
+{
+	struct value *val;
+
+	val = malloc(sizeof(struct value) + len + 1);
+	if (val == NULL)
+	{
+		fprintf(stderr, "%s: allocation failed (%zu)\n", __FUNCTION__, len);
+		return NULL;
+	}
+
+	val->chain = NULL;
+	val->refs = 1;
+	val->hash = hash;
+	val->len = len;
+	memcpy(val->str, str, len + 1);
+
+	return val;
+}
+
+// Short values are private copies, long ones are looked up first
+DBG_STATIC char *value_make(const char *str, size_t len, unsigned int hash)
+{
+	struct value **link, *val;
+
+	if (len < VALUE_SHARE_MIN)
+	{
+		val = value_alloc(str, len, hash);
+		return val ? val->str : NULL;
+	}
+
+	ithread_mutex_lock(&value_mutex);
+
+	link = &value_buckets[hash % VALUE_BUCKETS];
+	for (val = *link; val; val = val->chain)
+	{
+		if ((val->hash == hash) && (val->len == len) && (memcmp(val->str, str, len) == 0))
+		{
+			g_atomic_int_inc(&val->refs);
+			goto out;
+		}
+	}
+
+	val = value_alloc(str, len, hash);
+	if (val)
+	{
+		val->chain = *link;
+		*link = val;
+	}
+
+out:
+	ithread_mutex_unlock(&value_mutex);
+
+	return val ? val->str : NULL;
+}
+
+char *value_new(const char *str)
+{
+	unsigned int hash;
+	size_t len;
+
+	hash = value_hash(str, &len);
+
+	return value_make(str, len, hash);
+}
+
+// Caller must already hold a reference (or the mutex guarding the owner)
+char *value_ref(char *value)
+{
+	if (value)
+		g_atomic_int_inc(&VALUE_OF(value)->refs);
+
+	return value;
+}
+
+void value_unref(char *value)
+{
+	struct value **link, *val;
+
+	if (value == NULL)
+		return;
+
+	val = VALUE_OF(value);
+
+	if (val->len < VALUE_SHARE_MIN)
+	{
+		if (g_atomic_int_dec_and_test(&val->refs))
+			free(val);
+		return;
+	}
+
+	// Interned - drop from the table before anyone can find it again
+	ithread_mutex_lock(&value_mutex);
+
+	if (g_atomic_int_dec_and_test(&val->refs))
+	{
+		for (link = &value_buckets[val->hash % VALUE_BUCKETS]; *link; link = &(*link)->chain)
+		{
+			if (*link == val)
+			{
+				*link = val->chain;
+				break;
+			}
+		}
+		free(val);
+	}
+
+	ithread_mutex_unlock(&value_mutex);
+
+	return;
+}
+
+// Replace the value in 'slot' with 'str'
+// Returns FALSE (and leaves the slot alone) if the value is unchanged
+// Note: caller must hold the mutex guarding 'slot'
+int value_set(char **slot, const char *str)
+{
+	struct value *old = NULL;
+	unsigned int hash;
+	size_t len;
+	char *value;
+
+	if (*slot == str)
+		return FALSE;
+
+	hash = value_hash(str, &len);
+
+	if (*slot)
+	{
+		// Length and hash settle nearly every real change
+		old = VALUE_OF(*slot);
+		if ((old->hash == hash) && (old->len == len) && (memcmp(old->str, str, len) == 0))
+			return FALSE;
+	}
+
+	value = value_make(str, len, hash);
+	if (value == NULL)
+		return FALSE;
+
+	*slot = value;
+
+	if (old)
+		value_unref(old->str);
+
+	return TRUE;
+}
+
+DBG_STATIC void value_format(param_format format, long long number, char *buf, size_t len)
+{
+	unsigned long secs, hh, mm, ss;
+
+	if (format != VARFMT_TIME)
+	{
+		snprintf(buf, len, "%lld", number);
+		return;
+	}
+
+	secs = (number > 0) ? number / 1000 : 0;
+	hh = secs / 3600;
+	mm = (secs / 60) % 60;
+	ss = secs % 60;
+	snprintf(buf, len, "%02lu:%02lu:%02lu", hh, mm, ss);
+
+	return;
+}
+
+// Current string value of a service variable (NULL if never set)
+// Note: caller must hold service mutex
+char *value_get_var(struct service *srv, int varnum)
+{
+	struct var_number *num;
+	char buf[32];
+
+	if (srv->variable_numbers == NULL)
+		return srv->variable_values[varnum];
+
+	num = &srv->variable_numbers[varnum];
+	if (num->state == VARNUM_STALE)
+	{
+		value_format(srv->variable_meta[varnum].format, num->value, buf, sizeof(buf));
+		value_set(&srv->variable_values[varnum], buf);
+		num->state = VARNUM_CURRENT;
+	}
+
+	return srv->variable_values[varnum];
+}
+
+// Store a typed value, time values are kept to the second
+// Returns FALSE if the value is unchanged
+// Note: caller must hold service mutex
+int value_set_number(struct service *srv, int varnum, long long number)
+{
+	struct var_number *num = &srv->variable_numbers[varnum];
+
+	if (srv->variable_meta[varnum].format == VARFMT_TIME)
+		number -= number % 1000;
+
+	if ((num->state != VARNUM_UNSET) && (num->value == number))
+		return FALSE;
+
+	num->value = number;
+	num->state = VARNUM_STALE;
+
+	return TRUE;
+}
@@ -0,0 +1,39 @@
+/* value.h - Shared state variable values
+ *
+ * Copyright (C) 2012	     Ted Hess (Kitschensync)
+ *
+ * This file is part of UPnPMPD.
+ *
+ * UPnPMPD is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * UPnPMPD is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with UPnPMPD; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _VALUE_H
+#define _VALUE_H
+
+// Values at least this long are shared between variables (and services)
+#define VALUE_SHARE_MIN		64
+
+struct service;
+
+extern char *value_new(const char *str);
+extern char *value_ref(char *value);
+extern void value_unref(char *value);
+extern int value_set(char **slot, const char *str);
+extern char *value_get_var(struct service *srv, int varnum);
+extern int value_set_number(struct service *srv, int varnum, long long number);
+
+#endif /* _VALUE_H */
@@ -24,89 +24,178 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+
+#include <glib.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "logging.h"
 #include "xmlescape.h"
 
+/*
+ * Most values (URIs, numbers, state names) need no escaping at all and
+ * metadata has long runs between markup characters. Find the next
+ * character to escape (or the terminating NUL) a vector at a time, then
+ * copy the whole run at once.
+ *
+ * Vector loads are aligned so they never cross into the next page, bytes
+ * before the start of the string are masked off.
+ */
 
-DBG_STATIC void xmlescape_real(const char *str, char *target, int * length, int attribute)
+#if defined(__AVX2__)
+DBG_STATIC size_t xmlescape_span(const char *str, int attribute)
 {
-	if (target != NULL)
+	const char *p = (const char *)((uintptr_t)str & ~(uintptr_t)31);
+	const __m256i lt = _mm256_set1_epi8('<');
+	const __m256i gt = _mm256_set1_epi8('>');
+	const __m256i amp = _mm256_set1_epi8('&');
+	const __m256i quot = _mm256_set1_epi8(attribute ? '"' : '\0');
+	const __m256i nul = _mm256_setzero_si256();
+	__m256i v, m;
+	unsigned int mask;
+
+	v = _mm256_load_si256((const __m256i *)p);
+	m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, lt), _mm256_cmpeq_epi8(v, gt)),
+			    _mm256_or_si256(_mm256_cmpeq_epi8(v, amp), _mm256_cmpeq_epi8(v, quot)));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, nul));
+	mask = (unsigned int)_mm256_movemask_epi8(m) & (~0u << (str - p));
+
+	while (mask == 0)
 	{
-		int len = 0;
-
-		for (; *str; str++)
-		{
-			if (*str == '<')
-			{
-				memcpy(target + len, "&lt;", 4);
-				len += 4;
-			}
-			else if (attribute && (*str == '"'))
-			{
-				memcpy(target + len, "%22", 3);
-				len += 3;
-			}
-			else if (*str == '>')
-			{
-				memcpy(target + len, "&gt;", 4);
-				len += 4;
-			}
-			else if (*str == '&')
-			{
-				memcpy(target + len, "&amp;", 5);
-				len += 5;
-			}
-			else
-			{
-				target[len++] = *str;
-			}
-		}
-		target[len] = '\0';
-
-		if (length != NULL)
-			*length = len;
+		p += 32;
+		v = _mm256_load_si256((const __m256i *)p);
+		m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, lt), _mm256_cmpeq_epi8(v, gt)),
+				    _mm256_or_si256(_mm256_cmpeq_epi8(v, amp), _mm256_cmpeq_epi8(v, quot)));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, nul));
+		mask = (unsigned int)_mm256_movemask_epi8(m);
 	}
-	else if (length != NULL)
+
+	return (p + __builtin_ctz(mask)) - str;
+}
+#elif defined(__SSE2__)
+DBG_STATIC size_t xmlescape_span(const char *str, int attribute)
+{
+	const char *p = (const char *)((uintptr_t)str & ~(uintptr_t)15);
+	const __m128i lt = _mm_set1_epi8('<');
+	const __m128i gt = _mm_set1_epi8('>');
+	const __m128i amp = _mm_set1_epi8('&');
+	const __m128i quot = _mm_set1_epi8(attribute ? '"' : '\0');
+	const __m128i nul = _mm_setzero_si128();
+	__m128i v, m;
+	unsigned int mask;
+
+	v = _mm_load_si128((const __m128i *)p);
+	m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, lt), _mm_cmpeq_epi8(v, gt)),
+			 _mm_or_si128(_mm_cmpeq_epi8(v, amp), _mm_cmpeq_epi8(v, quot)));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, nul));
+	mask = (unsigned int)_mm_movemask_epi8(m) & (~0u << (str - p));
+
+	while (mask == 0)
 	{
-		int len = 0;
-
-		for (; *str; str++)
-		{
-			if (*str == '<')
-			{
-				len += 4;
-			}
-			else if (attribute && (*str == '"'))
-			{
-				len += 3;
-			}
-			else if (*str == '>')
-			{
-				len += 4;
-			}
-			else if (*str == '&')
-			{
-				len += 5;
-			}
-			else
-			{
-				len++;
-			}
-		}
-
-		*length = len;
+		p += 16;
+		v = _mm_load_si128((const __m128i *)p);
+		m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, lt), _mm_cmpeq_epi8(v, gt)),
+				 _mm_or_si128(_mm_cmpeq_epi8(v, amp), _mm_cmpeq_epi8(v, quot)));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, nul));
+		mask = (unsigned int)_mm_movemask_epi8(m);
 	}
+
+	return (p + __builtin_ctz(mask)) - str;
+}
+#else
+// Characters ending a run: 1 - always, 2 - in attributes
+static const unsigned char xmlescape_stop[256] =
+{
+	['\0'] = 1, ['<'] = 1, ['>'] = 1, ['&'] = 1, ['"'] = 2
+};
+
+DBG_STATIC size_t xmlescape_span(const char *str, int attribute)
+{
+	const unsigned char *p = (const unsigned char *)str;
+	unsigned char stop = (attribute) ? 3 : 1;
+
+	while ((xmlescape_stop[*p] & stop) == 0)
+		p++;
+
+	return (const char *)p - str;
+}
+#endif
+
+// Replacement for a character ending a run
+static const char *xmlescape_entity(char c)
+{
+	switch (c)
+	{
+	case '<':
+		return "&lt;";
+	case '>':
+		return "&gt;";
+	case '&':
+		return "&amp;";
+	case '"':
+		return "&quot;";
+	default:
+		return NULL;
+	}
+}
+
+// Escape 'str' onto the end of 'buf'
+void xmlescape_append(GString *buf, const char *str, int attribute)
+{
+	size_t len;
+
+	for (;;)
+	{
+		len = xmlescape_span(str, attribute);
+		if (len)
+			g_string_append_len(buf, str, len);
+		str += len;
+
+		if (*str == '\0')
+			break;
+
+		g_string_append(buf, xmlescape_entity(*str));
+		str++;
+	}
+
+	return;
+}
+
+// Escaped copy of 'str' - or 'str' itself if nothing needs escaping
+// '*copy' is set to what the caller must free (NULL if borrowed)
+const char *xmlescape_lazy(const char *str, int attribute, char **copy)
+{
+	size_t len;
+	GString *buf;
+
+	len = xmlescape_span(str, attribute);
+	if (str[len] == '\0')
+	{
+		*copy = NULL;
+		return str;
+	}
+
+	// Leave room for a few entities
+	buf = g_string_sized_new(len + (len >> 3) + 16);
+	g_string_append_len(buf, str, len);
+	xmlescape_append(buf, str + len, attribute);
+
+	*copy = g_string_free(buf, FALSE);
+
+	return *copy;
 }
 
 char *xmlescape(const char *str, int attribute)
 {
-	int len;
-	char *out;
+	const char *out;
+	char *copy;
 
-	xmlescape_real(str, NULL, &len, attribute);
-	out = malloc(len + 1);
-	xmlescape_real(str, out, NULL, attribute);
+	out = xmlescape_lazy(str, attribute, &copy);
 
-	return out;
+	return (copy) ? copy : strdup(out);
 }
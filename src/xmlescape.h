@@ -25,6 +25,10 @@
 #ifndef _XMLESCAPE_H
 #define _XMLESCAPE_H
 
+#include <glib.h>
+
 char *xmlescape(const char *str, int attribute);
+const char *xmlescape_lazy(const char *str, int attribute, char **copy);
+void xmlescape_append(GString *buf, const char *str, int attribute);
 
 #endif /* _XMLESCAPE_H */
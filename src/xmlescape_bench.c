@@ -0,0 +1,198 @@
+/* xmlescape_bench.c - microbenchmark for XML escaping
+ *
+ * Copyright (C) 2012	     Ted Hess (Kitschensync)
+ *
+ * This file is part of UPnPMPD.
+ *
+ * UPnPMPD is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * UPnPMPD is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with UPnPMPD; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Build with 'make xmlescape_bench' (not installed).
+ * Compares the byte-at-a-time two pass escape with the current one.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <glib.h>
+
+#include "xmlescape.h"
+
+#define BENCH_ROUNDS	200000
+
+static const char *bench_didl =
+	"<DIDL-Lite xmlns=\"urn:schemas-upnp-org:metadata-1-0/DIDL-Lite/\" "
+	"xmlns:upnp=\"urn:schemas-upnp-org:metadata-1-0/upnp/\" "
+	"xmlns:dc=\"http://purl.org/dc/elements/1.1/\" "
+	"xmlns:dlna=\"urn:schemas-dlna-org:metadata-1-0/\">"
+	"<item id=\"taz1l0z1l3z1l1547zal290\" parentID=\"taz1l0z1l3z1l1547z5l1548l40\" restricted=\"1\">"
+	"<upnp:class>object.item.audioItem.musicTrack</upnp:class>"
+	"<dc:title>Kubik</dc:title>"
+	"<dc:creator>Perry O'Neil</dc:creator>"
+	"<upnp:artist>Perry O'Neil</upnp:artist>"
+	"<upnp:albumArtURI>http://10.0.2.35:53168/content/wacky-file-name</upnp:albumArtURI>"
+	"<upnp:genre>Electronica &amp; Dance</upnp:genre>"
+	"<upnp:album>State of Trance 2004 Disc 2</upnp:album>"
+	"<upnp:originalTrackNumber>1</upnp:originalTrackNumber>"
+	"<dc:date>2004-01-01T00:00:00</dc:date>"
+	"<res protocolInfo=\"http-get:*:audio/mpeg:DLNA.ORG_PN=MP3;DLNA.ORG_OP=01;DLNA.ORG_CI=0;"
+	"DLNA.ORG_FLAGS=01700000000000000000000000000000\" bitrate=\"16000\" "
+	"sampleFrequency=\"44100\" duration=\"0:07:47.000\">"
+	"http://10.0.2.35:53168/content/taz1l0z1l3z1l1547zal290</res>"
+	"</item></DIDL-Lite>";
+
+static const char *bench_uri =
+	"http://10.0.2.35:53168/content/taz1l0z1l3z1l1547zal290?format=flac;quality=lossless";
+
+// Previous algorithm - size pass then byte-at-a-time copy pass
+static char *escape_twopass(const char *str, int attribute)
+{
+	const char *p;
+	char *out, *q;
+	int len = 0;
+
+	for (p = str; *p; p++)
+	{
+		if ((*p == '<') || (*p == '>'))
+			len += 4;
+		else if (*p == '&')
+			len += 5;
+		else if (attribute && (*p == '"'))
+			len += 6;
+		else
+			len++;
+	}
+
+	out = q = malloc(len + 1);
+	for (p = str; *p; p++)
+	{
+		if (*p == '<')
+		{
+			memcpy(q, "&lt;", 4);
+			q += 4;
+		}
+		else if (*p == '>')
+		{
+			memcpy(q, "&gt;", 4);
+			q += 4;
+		}
+		else if (*p == '&')
+		{
+			memcpy(q, "&amp;", 5);
+			q += 5;
+		}
+		else if (attribute && (*p == '"'))
+		{
+			memcpy(q, "&quot;", 6);
+			q += 6;
+		}
+		else
+		{
+			*q++ = *p;
+		}
+	}
+	*q = '\0';
+
+	return out;
+}
+
+static double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static void bench_report(const char *name, const char *payload, double start)
+{
+	double secs = bench_now() - start;
+
+	printf("  %-22s %8.1f ns/call %8.1f MB/s\n", name,
+	       (secs * 1e9) / BENCH_ROUNDS,
+	       (strlen(payload) * (double)BENCH_ROUNDS) / (secs * 1e6));
+}
+
+static void bench_payload(const char *label, const char *payload)
+{
+	GString *buf;
+	char *copy;
+	double start;
+	int i;
+
+	printf("%s (%zu bytes)\n", label, strlen(payload));
+
+	start = bench_now();
+	for (i = 0; i < BENCH_ROUNDS; i++)
+		free(escape_twopass(payload, 0));
+	bench_report("two pass", payload, start);
+
+	start = bench_now();
+	for (i = 0; i < BENCH_ROUNDS; i++)
+		free(xmlescape(payload, 0));
+	bench_report("xmlescape", payload, start);
+
+	start = bench_now();
+	for (i = 0; i < BENCH_ROUNDS; i++)
+	{
+		xmlescape_lazy(payload, 0, &copy);
+		if (copy)
+			free(copy);
+	}
+	bench_report("xmlescape_lazy", payload, start);
+
+	buf = g_string_sized_new(2 * strlen(payload));
+	start = bench_now();
+	for (i = 0; i < BENCH_ROUNDS; i++)
+	{
+		g_string_truncate(buf, 0);
+		xmlescape_append(buf, payload, 1);
+	}
+	bench_report("xmlescape_append", payload, start);
+	g_string_free(buf, TRUE);
+}
+
+int main(int argc, char **argv)
+{
+	char *check, *expect;
+	int rc;
+
+	// Same result as the reference first
+	check = xmlescape(bench_didl, 1);
+	expect = escape_twopass(bench_didl, 1);
+	rc = strcmp(check, expect);
+	free(check);
+	free(expect);
+	if (rc != 0)
+	{
+		fputs("xmlescape mismatch!\n", stderr);
+		return 1;
+	}
+
+	bench_payload("DIDL-Lite metadata", bench_didl);
+	bench_payload("Track URI", bench_uri);
+
+	return 0;
+}